@@ -1,5 +1,11 @@
 
+#define _POSIX_C_SOURCE 200112L /* getc_unlocked */
+
 #include <setjmp.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lines.h"
 #include "common.h"
@@ -7,6 +13,8 @@
 #define BUF_ABORT nomem()
 #include "buf.h"
 
+#define UNMAPSTEP 256 /* pages, unmaplines() */
+
 /* one line from fp, NUL terminate, return #chars (w/o NUL) */
 size_t appendline(char **buf, FILE *fp)
 {
@@ -15,9 +23,11 @@ size_t appendline(char **buf, FILE *fp)
   const int delim = '\n';
 
   n0 = buf_size(*buf);
-  while ((c = getc(fp)) != EOF && c != delim) {
+  flockfile(fp); /* lock once, not for every getc() */
+  while ((c = getc_unlocked(fp)) != EOF && c != delim) {
     buf_push(*buf, c);
   }
+  funlockfile(fp);
   if (c == delim) buf_push(*buf, delim);
   n1 = buf_size(*buf);
 
@@ -48,16 +58,27 @@ size_t countlines(struct lines *plines)
   return buf_size(plines->linepos);
 }
 
+/* the number of bytes in linebuf (including NULs), or mapped */
+size_t countbytes(struct lines *plines)
+{
+  return plines->map ? plines->mapsize : buf_size(plines->linebuf);
+}
+
 void clearlines(struct lines *plines)
 {
+  if (plines->map) {
+    munmap(plines->map, plines->mapsize);
+    plines->map = plines->linebuf = 0;
+    plines->mapsize = 0;
+  }
   buf_clear(plines->linebuf);
   buf_clear(plines->linepos);
 }
 
-/* return <0 on error, 0 on eof */
+/* return <0 on error, 0 on eof, 1 if chunksize was reached */
 int readlines(struct lines *plines, FILE *fp)
 {
-  size_t pos = 0;
+  size_t pos = buf_size(plines->linebuf), used = 0;
   size_t limit = plines->chunksize;
 
   for (;;) {
@@ -66,8 +87,115 @@ int readlines(struct lines *plines, FILE *fp)
     buf_push(plines->linepos, pos);
     pos += n; /* advance position in linebuf */
     pos += 1; /* NUL is not counted by n */
-    if (0 < limit && limit <= pos) return 1;
+    used += n + 1 + plines->overhead;
+    if (0 < limit && limit <= used) return 1;
+  }
+}
+
+/* Mapped lines: maplines() maps the rest of a regular file and
+   indexes its lines right in the mapping, where they end with their
+   newline (or at the end of the file) instead of a NUL; the mapping
+   is private, so the file is not changed; writelines() and
+   freelines() know about mapped lines, and unmaplines() copies them
+   to linebuf in the usual format, if NULs are needed */
+
+/* map fp and index its lines; return 1 if mapped, 0 if fp is not a
+   regular file (or empty, or cannot be mapped), or if its lines
+   do not fit into chunksize (counted as by readlines()), and the
+   caller should use readlines(); plines must be empty */
+int maplines(struct lines *plines, FILE *fp)
+{
+  struct stat st;
+  size_t i, n, size, used = 0;
+  size_t limit = plines->chunksize;
+  off_t off;
+  char *map, *p, *q, *end;
+
+  if (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+  if ((off = ftello(fp)) < 0 || off >= st.st_size) return 0;
+  if ((off_t) (size_t) st.st_size != st.st_size) return 0; /* too big */
+  if (0 < limit && limit <= (size_t) (st.st_size - off)) return 0;
+  size = st.st_size;
+  map = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+  if (map == MAP_FAILED) return 0;
+
+  /* count the lines first, so that linepos is allocated once;
+     give up as soon as they exceed the limit */
+  end = map + size;
+  for (n = 0, p = map + off; p < end; n++, p = q) {
+    q = memchr(p, '\n', end - p);
+    q = q ? q+1 : end;
+    used += (q - p) + 1 + plines->overhead;
+    if (0 < limit && limit <= used) {
+      munmap(map, size);
+      return 0;
+    }
+  }
+  buf_grow(plines->linepos, n);
+  for (i = 0, p = map + off; i < n; i++) {
+    buf_push(plines->linepos, p - map);
+    p = memchr(p, '\n', end - p);
+    p = p ? p+1 : end;
+  }
+
+  plines->map = plines->linebuf = map;
+  plines->mapsize = size;
+  return 1;
+}
+
+/* length of mapped line s, with its newline, if any */
+static size_t maplen(struct lines *plines, const char *s)
+{
+  const char *end = plines->map + plines->mapsize;
+  const char *p = memchr(s, '\n', end - s);
+  return p ? (size_t) (p+1 - s) : (size_t) (end - s);
+}
+
+/* copy mapped lines to linebuf, NUL-terminated (with a newline
+   added to an incomplete last line), and drop the mapping as we
+   go, so the file is not held in memory twice */
+void unmaplines(struct lines *plines)
+{
+  char *map = plines->map, *buf = 0, *s;
+  size_t i, len, pos = 0, n = countlines(plines);
+  size_t step = UNMAPSTEP * sysconf(_SC_PAGESIZE), done = 0;
+
+  if (!map) return;
+  /* every line gains a NUL, and the last one maybe a newline */
+  buf_grow(buf, plines->mapsize - (n ? plines->linepos[0] : 0) + n + 1);
+  for (i = 0; i < n; i++) {
+    s = map + plines->linepos[i];
+    len = maplen(plines, s);
+    memcpy(buf + pos, s, len);
+    if (s[len-1] != '\n')
+      buf[pos + len++] = '\n';
+    buf[pos + len] = 0;
+    plines->linepos[i] = pos;
+    pos += len + 1;
+    if ((size_t) (s - map) >= done + step) { /* lines are in file order */
+      munmap(map + done, step);
+      done += step;
+    }
   }
+  buf_ptr(buf)->size = pos; /* as if pushed */
+
+  munmap(map + done, plines->mapsize - done);
+  plines->map = 0;
+  plines->mapsize = 0;
+  plines->linebuf = buf;
+}
+
+/* the bytes allocated for linebuf (or mapped) and for linepos */
+void sizelines(struct lines *plines, size_t *plinebuf, size_t *plinepos)
+{
+  *plinebuf = plines->map ? plines->mapsize : buf_capacity(plines->linebuf);
+  *plinepos = buf_capacity(plines->linepos) * sizeof(*plines->linepos);
+}
+
+/* keep only the first n lines (in linepos order) */
+void trunclines(struct lines *plines, size_t n)
+{
+  buf_trunc(plines->linepos, n);
 }
 
 /* write lines in linepos-order to fp */
@@ -79,13 +207,23 @@ void writelines(struct lines *plines, FILE *fp)
   for (i = 0; i < n; i++) {
     k = plines->linepos[i];
     s = plines->linebuf + k;
-    fputs(s, fp);
+    if (plines->map) {
+      size_t len = maplen(plines, s);
+      fwrite(s, 1, len, fp);
+      if (s[len-1] != '\n') putc('\n', fp);
+    }
+    else fputs(s, fp);
   }
 }
 
 /* free the linebuf and linepos memory */
 void freelines(struct lines *plines)
 {
+  if (plines->map) {
+    munmap(plines->map, plines->mapsize);
+    plines->map = plines->linebuf = 0;
+    plines->mapsize = 0;
+  }
   buf_free(plines->linebuf);
   buf_free(plines->linepos);
 }
@@ -3,9 +3,12 @@
 #include <stdio.h>
 
 struct lines {
-  char *linebuf; /* buf.h */
+  char *linebuf; /* buf.h, or the mapping if map is set */
   size_t *linepos; /* buf.h */
   size_t chunksize;
+  size_t overhead; /* bytes per line counted against chunksize */
+  char *map; /* maplines(): the mapped file, else 0 */
+  size_t mapsize;
 };
 
 size_t appendline(char **buf, FILE *fp);
@@ -14,6 +17,11 @@ void freeline(char **buf);
 
 void clearlines(struct lines *plines);
 int readlines(struct lines *plines, FILE *fp);
+int maplines(struct lines *plines, FILE *fp);
+void unmaplines(struct lines *plines);
 size_t countlines(struct lines *plines);
+size_t countbytes(struct lines *plines);
+void sizelines(struct lines *plines, size_t *plinebuf, size_t *plinepos);
+void trunclines(struct lines *plines, size_t n);
 void writelines(struct lines *plines, FILE *fp);
 void freelines(struct lines *plines);
@@ -0,0 +1,133 @@
+/* lz.c - fast LZ77 block compression
+ *
+ * A packed block is a sequence of (literals, match) pairs; each starts
+ * with a token byte: its high nibble is the number of literal bytes
+ * and its low nibble is the match length minus MINMATCH; a nibble of
+ * 15 means more length bytes follow, each added in, until one is less
+ * than 255. Then come the literal bytes, then the match offset (two
+ * bytes, little-endian), then more match length bytes, if any. The
+ * last pair has only literals and ends the block. This is the format
+ * of LZ4, which is byte-oriented and therefore fast to unpack.
+ *
+ * Matches are found through a hash table of recent 4-byte strings;
+ * only the most recent occurrence is kept, so we find fewer matches
+ * than we might, but we find them quickly.
+ */
+
+#include <stdint.h>  /* uint32_t */
+#include <string.h>  /* memcpy() */
+
+#include "lz.h"
+
+#define MINMATCH 4
+#define MAXOFFSET 65535
+#define HASHBITS 13
+#define MORE 15 /* nibble value: length continues */
+
+#define MIN(x,y) ((x)<(y)?(x):(y))
+
+static uint32_t
+read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned
+hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - HASHBITS);
+}
+
+static unsigned char * /* emit length bytes for n */
+putlen(unsigned char *op, size_t n)
+{
+  for (; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = (unsigned char) n;
+  return op;
+}
+
+static unsigned char * /* emit token and literals */
+putlits(unsigned char *op, const unsigned char *lp, size_t n, size_t mlen)
+{
+  *op++ = (unsigned char) (MIN(n, MORE) << 4 | MIN(mlen, MORE));
+  if (n >= MORE) op = putlen(op, n - MORE);
+  memcpy(op, lp, n);
+  return op + n;
+}
+
+size_t
+lzpack(const void *src, size_t n, void *dst)
+{
+  const unsigned char *base = src;
+  const unsigned char *ip = base, *anchor = base, *end = base + n;
+  unsigned char *op = dst;
+  uint32_t table[1 << HASHBITS] = { 0 }; /* hash -> offset from base */
+
+  while (end - ip >= MINMATCH) {
+    uint32_t v = read32(ip);
+    unsigned h = hash(v);
+    const unsigned char *ref = base + table[h];
+    table[h] = ip - base;
+    if (ref >= ip || ip - ref > MAXOFFSET || read32(ref) != v) {
+      ip++;
+      continue;
+    }
+    const unsigned char *mp = ip + MINMATCH, *rp = ref + MINMATCH;
+    while (mp < end && *mp == *rp) mp++, rp++;
+    size_t mlen = mp - ip - MINMATCH;
+    size_t off = ip - ref;
+    op = putlits(op, anchor, ip - anchor, mlen);
+    *op++ = off & 255;
+    *op++ = off >> 8;
+    if (mlen >= MORE) op = putlen(op, mlen - MORE);
+    ip = anchor = mp;
+  }
+
+  op = putlits(op, anchor, end - anchor, 0);
+  return op - (unsigned char *) dst;
+}
+
+static int /* read more length bytes into *pn; 0 if out of input */
+getlen(const unsigned char **pp, const unsigned char *end, size_t *pn)
+{
+  unsigned c;
+  do {
+    if (*pp >= end) return 0;
+    c = *(*pp)++;
+    *pn += c;
+  } while (c == 255);
+  return 1;
+}
+
+size_t
+lzunpack(const void *src, size_t n, void *dst, size_t cap)
+{
+  const unsigned char *ip = src, *end = ip + n;
+  unsigned char *base = dst, *op = base, *oend = base + cap;
+
+  while (ip < end) {
+    unsigned token = *ip++;
+    size_t lits = token >> 4, mlen = token & 15, off;
+    if (lits == MORE && !getlen(&ip, end, &lits)) return LZ_ERROR;
+    if (lits > (size_t) (end - ip) || lits > (size_t) (oend - op))
+      return LZ_ERROR;
+    memcpy(op, ip, lits);
+    op += lits;
+    ip += lits;
+    if (ip == end) break; /* last pair has no match */
+    if (end - ip < 2) return LZ_ERROR;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (off == 0 || off > (size_t) (op - base)) return LZ_ERROR;
+    if (mlen == MORE && !getlen(&ip, end, &mlen)) return LZ_ERROR;
+    mlen += MINMATCH;
+    if (mlen > (size_t) (oend - op)) return LZ_ERROR;
+    const unsigned char *mp = op - off;
+    while (mlen--) *op++ = *mp++; /* may overlap */
+  }
+
+  return op - base;
+}
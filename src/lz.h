@@ -0,0 +1,19 @@
+#pragma once
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/* max packed size of n bytes (incompressible input grows a little) */
+#define LZ_BOUND(n) ((n) + (n)/255 + 16)
+
+/* returned by lzunpack() if the packed data is corrupt */
+#define LZ_ERROR ((size_t) -1)
+
+/* pack n bytes at src into dst (room for LZ_BOUND(n)); return packed size */
+size_t lzpack(const void *src, size_t n, void *dst);
+
+/* unpack n bytes at src into dst (room for cap); return unpacked size */
+size_t lzunpack(const void *src, size_t n, void *dst, size_t cap);
+
+#endif
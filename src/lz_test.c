@@ -0,0 +1,68 @@
+/* Unit tests for lz.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "lz.h"
+
+static int
+RoundTrip(const char *s, size_t n, size_t *ppacked);
+
+void
+lz_test(int *pnumpass, int *pnumfail)
+{
+  int numpass = 0;
+  int numfail = 0;
+
+  size_t packed, i, n;
+  char text[4096], noise[4096];
+  char zbuf[LZ_BOUND(sizeof text)];
+  char out[16];
+
+  HEADING("Testing lz.c");
+
+  TEST("empty", RoundTrip("", 0, &packed) && packed == 1);
+  TEST("short", RoundTrip("abc", 3, &packed) && packed == 4);
+  TEST("no match", RoundTrip("abcdefgh", 8, 0));
+  TEST("overlapping match", RoundTrip("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 31, &packed) && packed < 10);
+  TEST("match at end", RoundTrip("abcdxabcd", 9, 0));
+  TEST("long literals", RoundTrip("0123456789abcdefghijklmnopqrstuvwxyz", 36, 0));
+
+  for (n = 0; n + 40 < sizeof text; )
+    n += sprintf(text+n, "line %04zu of some sorted text\n", n/37);
+  TEST("text", RoundTrip(text, n, &packed) && packed < n/2);
+  INFO("text: %zu bytes packed to %zu", n, packed);
+
+  srand(42);
+  for (i = 0; i < sizeof noise; i++) noise[i] = rand() & 255;
+  TEST("noise", RoundTrip(noise, sizeof noise, &packed) && packed <= LZ_BOUND(sizeof noise));
+
+  packed = lzpack("hello, hello, hello!", 20, zbuf);
+  TEST("too small", lzunpack(zbuf, packed, out, sizeof out) == LZ_ERROR);
+  TEST("truncated", lzunpack(zbuf, packed-9, out, sizeof out) == LZ_ERROR);
+  TEST("bad offset", lzunpack("\x40" "abcd" "\x09\x00", 7, out, sizeof out) == LZ_ERROR);
+  TEST("zero offset", lzunpack("\x40" "abcd" "\x00\x00", 7, out, sizeof out) == LZ_ERROR);
+
+  if (pnumpass) *pnumpass += numpass;
+  if (pnumfail) *pnumfail += numfail;
+}
+
+static int
+RoundTrip(const char *s, size_t n, size_t *ppacked)
+{
+  char *zbuf = malloc(LZ_BOUND(n));
+  char *out = malloc(n+1);
+  size_t packed, unpacked;
+  int ok;
+
+  packed = lzpack(s, n, zbuf);
+  unpacked = lzunpack(zbuf, packed, out, n);
+  ok = unpacked == n && memcmp(s, out, n) == 0;
+  if (ppacked) *ppacked = packed;
+
+  free(zbuf);
+  free(out);
+  return ok;
+}
@@ -13,6 +13,7 @@ extern void sorting_test(int *pnumpass, int *pnumfail);
 extern void regex_test(int *pnumpass, int *pnumfail);
 extern void utils_test(int *pnumpass, int *pnumfail);
 extern void eval_test(int *pnumpass, int *pnumfail);
+extern void lz_test(int *pnumpass, int *pnumfail);
 
 const char *me = "runtests";
 int verbosity = 0; /* ref'd from utils.c */
@@ -33,6 +34,7 @@ main(int argc, char **argv)
   utils_test(&numpass, &numfail);
   eval_test(&numpass, &numfail);
   sorting_test(&numpass, &numfail);
+  lz_test(&numpass, &numfail);
 
   SUMMARY(numpass, numfail);
   return numfail > 0 ? 1 : 0;
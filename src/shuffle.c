@@ -23,7 +23,7 @@ shufflecmd(int argc, char **argv)
   size_t n;
   long seed = -1;
   int num = -1;
-  struct lines lines = { 0, 0, 0 }; /* must zero-init for buf.h */
+  struct lines lines = { 0, 0, 0, 0, 0, 0 }; /* must zero-init for buf.h */
 
   r = parseopts(argc, argv, &seed, &num);
   if (r < 0) return FAILHARD;
@@ -45,8 +45,17 @@ shufflecmd(int argc, char **argv)
     return SUCCESS;
   }
 
+  /* a single regular file is mapped, not read */
   if (argc == 0 || !*argv) {
-    readlines(&lines, stdin);
+    if (!maplines(&lines, stdin))
+      readlines(&lines, stdin);
+  }
+  else if (argc == 1 || !argv[1]) {
+    FILE *fp = openin(*argv);
+    if (!fp) goto ioerr;
+    if (!maplines(&lines, fp))
+      readlines(&lines, fp);
+    fclose(fp); /* the mapping stays */
   }
   else while (*argv) {
     const char *fn = *argv++;
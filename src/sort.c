@@ -1,62 +1,228 @@
 /* sort - sort text lines */
 
+#define _POSIX_C_SOURCE 200112L /* pthreads */
+#define _XOPEN_SOURCE 600 /* realpath */
+
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "lines.h"
+#include "lz.h"
 #include "sorting.h"
 #include "strbuf.h"
 
+struct item {      /* entry in the sort index */
+  uint64_t prefix; /* leading key bytes, big-endian */
+  size_t pos;      /* offset of line in linebuf */
+};
+
+struct mergejob {
+  int lo, hi;     /* merge temp files lo..hi */
+  int out;        /* into temp file out */
+  size_t bufsize; /* input buffer per run */
+};
+
 static int memsort(struct lines *plines, FILE *fin, FILE *fout);
+static int sortout(struct lines *plines, FILE *fout);
+static bool ateof(FILE *fp);
+static void setlimit(struct lines *plines, size_t bytes);
 static int extsort(struct lines *plines, FILE *fin, FILE *fout);
-static void sortlines(struct lines *plines);
+static int runsort(struct lines *plines, FILE *fin, FILE *fout, bool bigchunk);
+static int distsort(struct lines *plines, FILE *fin, FILE *fout, bool bigchunk);
+static int topsort(int k, FILE *fin, FILE *fout);
+static int checksorted(FILE *fin, const char *name);
+static int mergefiles(int nfiles, char **paths, FILE *fout);
+static int sortlines(struct lines *plines);
+static int makeruns(struct lines *plines, FILE *fin, int first);
 static int compare(const char *s, const char *t);
+static int keycmp(const char *s, const char *t);
+static int keyedcmp(const char *sk, const char *s, const char *tk, const char *t);
+static bool samekey(const char *s, const char *t);
+static int setkey(char **pbuf, size_t *psize, const char *s);
+static int reserve(char **pbuf, size_t *psize, size_t n);
+static uint64_t keyprefix(const char *s);
 
+static int makespill(void);
+static void dropspill(void);
 static void nametemp(char *buf, size_t len, int num);
 static FILE *maketemp(int num);
 static FILE *opentemp(int num);
 static void droptemp(int num);
 static void opentemps(FILE **fps, int lo, int hi);
 static void droptemps(FILE **fps, int lo, int hi);
+static FILE *makeout(off_t size);
+static int startout(FILE *fp);
+static int closeout(FILE *fp, int r);
+static void dropout(void);
+static off_t insize(FILE *fp);
 
-static void merge(FILE **infps, int numfp, FILE *outfp);
-static void quick(size_t v[], size_t lo, size_t hi, const char *linebuf);
+static int mergeorder(int nruns, size_t mem, int nmerges);
+static int mergewidth(int nruns, size_t mem);
+static size_t mergebufsize(int k, size_t budget);
+static int domerge(int lo, int hi, int out, FILE *fout, size_t bufsize);
+static int runmerges(struct mergejob *mjobs, int njobs, int nthreads);
+static int merge(FILE **infps, int numfp, FILE *outfp, int flags);
+static int writerun(struct lines *plines, FILE *fp);
+static int copyrun(FILE *fp, FILE *fout);
+static void packstats(void);
+static void sortstats(void);
+static void sortitems(struct item v[], size_t n, const char *linebuf);
+static void quick(struct item v[], size_t lo, size_t hi, const char *linebuf);
+static void radix(struct item v[], size_t n, const char *linebuf);
+static bool natural(struct item v[], size_t n, const char *linebuf);
+static void psort(struct item v[], size_t n, const char *linebuf, int nthreads);
 
 static int parseopts(int argc, char **argv, size_t *chunksize);
+static size_t parsesize(const char *s);
+static int parsekey(const char *s);
 static void usage(const char *errmsg);
 
 static bool reverse = false;
 static bool casefold = false;
 static bool dictsort = false;
 static bool numeric = false;
+static bool decorate = false; /* sort on precomputed keys */
+static int keybeg = 0; /* -k: first key field, 0 for whole line */
+static int keyend = 0; /* -k: last key field, 0 for end of line */
+static char fieldseps[4] = " \t\n"; /* -t: field separator, and \n */
+static bool blanksep = true; /* no -t: fields separated by runs of blanks */
+static bool compress = false; /* pack temp files */
+static int jobs = 1;
+static int iojobs = 1; /* merges to run at once (-P) */
+static size_t budget = 0; /* memory budget (-S), 0 if none */
+static int topk = 0; /* output only the first topk lines (-m) */
+static bool mergeonly = false; /* merge presorted files (-M) */
+static bool distribute = false; /* external sort by distribution (-D) */
+static bool nocache = false; /* keep temp files out of the page cache (-N) */
+static bool checkonly = false; /* check that the input is sorted (-C) */
+static bool unique = false; /* drop lines with equal keys (-u) */
+static const char *outpath = 0; /* -o: output file, else stdout */
 
-#define MERGEORDER 5
+#define FDRESERVE 8 /* file descriptors not available for merging */
+#define MERGEBUFMIN BUFSIZ /* input buffer per run when merging */
+#define MERGEBUFMAX (64*1024)
+#define MAXJOBS 256
+#define PARMIN 4096 /* min lines per thread in parallel sort */
+#define RADIXMIN 32 /* smaller buckets are sorted by comparison */
+#define INSERTMAX 12 /* quick() uses insertion sort up to this size */
+#define MINRUN 32 /* natural(): shorter runs are extended */
+#define TOPMIN 1024 /* topsort(): slots to start with, doubled as needed */
+#define RUNAVG 8 /* natural(): give up if runs are shorter on average */
+#define SHORTMAX 8 /* natural(): give up after so many short runs in a row */
 #define PATHBUFLEN 256
+#define OUTBUFSIZE (1024*1024) /* -o: write the output in such blocks */
+#define MAXTEMPDIRS 16 /* -T options */
+#define RUNERR (-1) /* merge() etc.: error, reported */
+#define RUNNOMEM (-2) /* merge() etc.: out of memory, not reported */
+#define TEXTIN 1 /* merge(): input files are text */
+#define TEXTOUT 2 /* merge(): write text */
+#define MAXVARINT 10 /* bytes in a varint, at most */
+#define NCHUNKS 3  /* run pipeline: one each for reading, sorting, writing */
+#define BLOCKSIZE (64*1024) /* unpacked size of a run block */
+#define CACHEMEM (16*1024*1024) /* -N: page cache for temp files, about */
+#define CACHESTEP(nfiles) MAX(CACHEMEM / (2*(nfiles)), 2*BLOCKSIZE)
 #define CHECKIOERR(fp, msg) if (ferror(fp)) { \
   error("error %s", msg); return FAILSOFT; }
-#define CHECKTMPERR(fps, n, msg) do { for (int i=0;i<n;i++) \
-  if (ferror(fps[i])) { error("error %s", msg); return FAILSOFT; }} while(0)
+
+static const char *tempdirs[MAXTEMPDIRS]; /* -T */
+static int ntempdirs = 0;
+
+/* Statistics for verbose output: times are summed per stage, and
+   the stages overlap in the run pipeline and in parallel merges;
+   comparisons are counted per thread, only if verbose */
+
+struct counter {
+  size_t n;
+  struct counter *next;
+};
+
+static pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  struct counter *counters; /* comparisons, one per thread */
+  double readtime, sorttime, spilltime, mergetime, writetime;
+  size_t spilled, reread;   /* temp file bytes written and read */
+  int passes;               /* merge passes over temp files */
+  size_t linebuf, linepos;  /* peak bytes allocated for lines */
+  size_t unpacked, packed;  /* bytes in blocks written (-z) */
+  double iotime;            /* seconds spent on temp file blocks */
+  double packtime, unpacktime;
+  size_t dropped, readahead; /* -N: temp file bytes advised so */
+} stats;
+
+static bool counting = false; /* count comparisons */
+static pthread_key_t cmpkey;  /* this thread's counter */
+#define COUNTCMP() if (counting) countcmp()
+
+static double now(void);
+static void addtime(double *pt, double t0);
+static void countcmp(void);
+static void dropwritten(FILE *fp, off_t *plag, off_t *pmark, off_t off, bool last);
+static void notemem(size_t linebuf, size_t linepos);
 
 int
 sortcmd(int argc, char **argv)
 {
-  int r;
-  FILE *fin;
-  struct lines lines = { 0, 0, 0 }; /* must zero-init for buf.h */
+  int i, r;
+  FILE *fin, *fout;
+  const char *name = "stdin";
+  struct lines lines = { 0, 0, 0, 0, 0, 0 }; /* must zero-init for buf.h */
 
   r = parseopts(argc, argv, &lines.chunksize);
   if (r < 0) return FAILHARD;
   SHIFTARGS(argc, argv, r);
 
+  decorate = ((dictsort || casefold) && !numeric) || keybeg > 0;
+  if (verbosity > 0)
+    counting = pthread_key_create(&cmpkey, 0) == 0;
+
+  if (verbosity > 0)
+    fprintf(stderr, "(sorting with options: dict=%d, "
+      "fold=%d, numeric=%d, reverse=%d, chunksize=%zd, jobs=%d, "
+      "compress=%d, budget=%zd, top=%d, key=%d,%d, blanks=%d, merge=%d, "
+      "unique=%d, distribute=%d, nocache=%d, check=%d, merges=%d, "
+      "tempdirs=%d, output=%s)\n",
+      dictsort, casefold, numeric, reverse, lines.chunksize, jobs, compress,
+      budget, topk, keybeg, keyend, blanksep, mergeonly, unique, distribute,
+      nocache, checkonly, iojobs, ntempdirs, outpath ? outpath : "-");
+
+  if (mergeonly) {
+    off_t size = argc > 0 ? 0 : insize(stdin);
+    struct stat st;
+    for (i = 0; i < argc; i++)
+      if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode))
+        size += st.st_size;
+    if (!(fout = makeout(size))) return FAILSOFT;
+    r = closeout(fout, mergefiles(argc, argv, fout));
+    if (verbosity > 0) sortstats();
+    return r;
+  }
+
+  if (unique && topk > 0) {
+    usage("option -u cannot be used with -m");
+    return FAILHARD;
+  }
+
   if (argc > 0 && *argv) {
     argc--;
-    fin = openin(*argv++);
+    name = *argv++;
+    fin = openin(name);
     if (!fin) return FAILSOFT;
   }
   else fin = stdin;
@@ -67,17 +233,28 @@ sortcmd(int argc, char **argv)
     goto done;
   }
 
-  if (verbosity > 0)
-    fprintf(stderr, "(sorting with options: dict=%d, "
-      "fold=%d, numeric=%d, reverse=%d, chunksize=%zd)\n",
-      dictsort, casefold, numeric, reverse, lines.chunksize);
+  if (checkonly) {
+    r = checksorted(fin, name);
+    if (verbosity > 0) sortstats();
+    goto done;
+  }
+
+  if (!(fout = makeout(insize(fin)))) {
+    r = FAILSOFT;
+    goto done;
+  }
 
-  if (lines.chunksize > 0) {
-    r = extsort(&lines, fin, stdout);
+  if (topk > 0) {
+    r = topsort(topk, fin, fout);
+  }
+  else if (lines.chunksize > 0) {
+    r = extsort(&lines, fin, fout);
   }
   else {
-    r = memsort(&lines, fin, stdout);
+    r = memsort(&lines, fin, fout);
   }
+  r = closeout(fout, r);
+  if (verbosity > 0) sortstats();
 
 done:
   if (fin != stdin)
@@ -90,299 +267,2728 @@ done:
 static int
 memsort(struct lines *plines, FILE *fin, FILE *fout)
 {
-  readlines(plines, fin);
+  size_t linebuf, linepos;
+  double t0 = now();
+  int r;
+
+  if (budget > 0) setlimit(plines, budget);
+  if (maplines(plines, fin) > 0) {
+    /* a regular file that fits the budget: copy it from the
+       mapping at once, else it is read in chunks */
+    unmaplines(plines);
+    r = 0;
+  }
+  else r = readlines(plines, fin);
+  if (r > 0 && ateof(fin)) r = 0; /* fits exactly */
   CHECKIOERR(fin, "reading input");
+  addtime(&stats.readtime, t0);
+  sizelines(plines, &linebuf, &linepos);
+  notemem(linebuf, linepos);
+
+  if (r > 0) { /* did not fit into the budget */
+    if (verbosity > 0)
+      fprintf(stderr, "(input exceeds memory budget, sorting externally)\n");
+    return extsort(plines, fin, fout);
+  }
+
+  return sortout(plines, fout);
+}
+
+static int /* sort the lines in memory and write them to fout */
+sortout(struct lines *plines, FILE *fout)
+{
+  double t0;
 
-  sortlines(plines);
+  if (sortlines(plines) < 0) nomem();
 
+  t0 = now();
+  if (startout(fout) < 0) return FAILSOFT;
   writelines(plines, fout);
   CHECKIOERR(fout, "writing output");
+  addtime(&stats.writetime, t0);
 
   return SUCCESS;
 }
 
-static int
-extsort(struct lines *plines, FILE *fin, FILE *fout)
+static bool /* true if there is no more input (peeks a char) */
+ateof(FILE *fp)
 {
-  int lo = 0, hi = -1, r;
-  FILE *outfile, *infile;
-  FILE *infiles[MERGEORDER];
-
-  do {
-    clearlines(plines);
-    r = readlines(plines, fin);
-    CHECKIOERR(stdin, "reading input");
-    sortlines(plines);
-    FILE *outfile = maketemp(++hi);
-    if (!outfile) return FAILSOFT;
-    writelines(plines, outfile);
-    CHECKIOERR(outfile, "writing output");
-    fclose(outfile);
-  } while (r > 0);
+  int c = getc(fp);
+  if (c == EOF) return true;
+  ungetc(c, fp);
+  return false;
+}
 
-  while (lo < hi) {
-    int lim = MIN(lo+MERGEORDER-1, hi);
-    opentemps(infiles, lo, lim);
-    outfile = maketemp(++hi);
-    if (!outfile) return FAILSOFT;
-    merge(infiles, lim-lo+1, outfile);
-    fclose(outfile);
-    CHECKTMPERR(infiles, lim-lo+1, "merging");
-    droptemps(infiles, lo, lim);
-    lo += MERGEORDER;
-  }
-
-  infile = opentemp(hi);
-  filecopy(infile, fout);
-  fclose(infile);
-  droptemp(hi);
+/* Top-K: keep the k smallest lines seen so far in a heap whose root
+   is the largest of them (reheap() with the comparison reversed);
+   a new line replaces the root if it is smaller; each line costs
+   one comparison against the root, and log k more if it is kept;
+   the slots grow with the input, so a large k costs nothing if
+   the input is short */
 
-  if (verbosity > 0)
-    fprintf(stderr, "(external sorting used %d runs, "
-    "chunk size = %zd, merge order = %d)\n", hi+1, plines->chunksize, MERGEORDER);
+struct slot {
+  char *line;     /* buf.h */
+  char *key;      /* if decorate */
+  size_t keysize; /* allocated size of key */
+};
 
-  return SUCCESS;
+static int
+slotcmp(int i, int j, void *userdata)
+{
+  struct slot *slots = userdata;
+  COUNTCMP();
+  if (decorate)
+    return keyedcmp(slots[i].key, slots[i].line, slots[j].key, slots[j].line);
+  return compare(slots[i].line, slots[j].line);
 }
 
-/* dictionary sort: any non-alnum is a separator */
-#define ISSEP(c) (c && !isalnum(c))
-#define SKIPSEP(s) while (ISSEP(*s)) ++s
+static int
+maxheapcmp(int i, int j, void *userdata)
+{
+  return slotcmp(j, i, userdata);
+}
 
 static int
-compare(const char *s, const char *t)
+topsort(int k, FILE *fin, FILE *fout)
 {
-  int r, rev = reverse ? -1 : 1;
+  int size = (int) MIN(k, TOPMIN) + 1; /* up to k, and a spare */
+  struct slot *slots = calloc(size, sizeof(*slots));
+  int *heap = malloc((size+1) * sizeof(*heap)); /* heap[1..size] */
+  int i, n, spare, r = SUCCESS;
 
-  if (numeric) {
-    /* compare numeric prefix; ignore leading space */
-    /* lines w/o numeric prefix always sort at the end */
-    int i, j;
-    s += scanspace(s);
-    t += scanspace(t);
-    size_t m = scanint(s, &i);
-    size_t n = scanint(t, &j);
-    if (m > 0 && n > 0) {
-      if (i < j) return -1*rev;
-      if (j < i) return +1*rev;
-      s += m; t += n;
+  if (!slots || !heap) nomem();
+
+  for (n = 0; n < k; n++) { /* fill the heap */
+    if (n+1 == size) { /* keep room for a spare */
+      int m = (int) MIN(2 * (long) size, (long) k + 1);
+      struct slot *sp = realloc(slots, m * sizeof(*slots));
+      if (!sp) nomem();
+      slots = sp;
+      int *hp = realloc(heap, (m+1) * sizeof(*heap));
+      if (!hp) nomem();
+      heap = hp;
+      memset(slots + size, 0, (m - size) * sizeof(*slots));
+      size = m;
     }
-    else if (m > 0) return -1;
-    else if (n > 0) return +1;
-    /* numeric prefix equal (or both missing) */
+    if (appendline(&slots[n].line, fin) == 0) break;
+    if (decorate && setkey(&slots[n].key, &slots[n].keysize, slots[n].line) < 0)
+      nomem();
+    heap[n+1] = n;
   }
+  /* descending order has the heap property */
+  quicksort(heap+1, n, maxheapcmp, slots);
 
-  if (dictsort) {
-    const unsigned char *ss = (void *) s;
-    const unsigned char *tt = (void *) t;
-    SKIPSEP(ss); SKIPSEP(tt);
-    while (*ss && *tt) {
-      if (*ss == *tt) { ++ss; ++tt; continue; }
-      if (casefold && tolower(*ss) == tolower(*tt)) { ++ss; ++tt; continue; }
-      int match = ISSEP(*ss) && ISSEP(*tt);
-      SKIPSEP(ss); SKIPSEP(tt);
-      if (!match) break;
+  for (spare = n; n == k; truncline(&slots[spare].line)) {
+    struct slot *sp = &slots[spare];
+    if (appendline(&sp->line, fin) == 0) break;
+    if (decorate && setkey(&sp->key, &sp->keysize, sp->line) < 0)
+      nomem();
+    if (slotcmp(spare, heap[1], slots) < 0) {
+      i = heap[1];
+      heap[1] = spare;
+      spare = i;
+      reheap(heap, k, maxheapcmp, slots);
     }
-    SKIPSEP(ss); SKIPSEP(tt);
-    r = casefold ? tolower(*ss) - tolower(*tt) : *ss - *tt;
   }
-  else if (casefold) {
-    const unsigned char *ss = (void *) s;
-    const unsigned char *tt = (void *) t;
-    while (*ss && *tt && (*ss == *tt || tolower(*ss) == tolower(*tt))) ++ss, ++tt;
-    r = tolower(*ss) - tolower(*tt);
+  CHECKIOERR(fin, "reading input");
+
+  quicksort(heap+1, n, slotcmp, slots);
+  double t0 = now();
+  if (startout(fout) < 0) r = FAILSOFT;
+  else for (i = 1; i <= n; i++)
+    fputs(slots[heap[i]].line, fout);
+  addtime(&stats.writetime, t0);
+
+  for (i = 0; i < size; i++) {
+    freeline(&slots[i].line);
+    free(slots[i].key);
   }
-  else r = strcmp(s, t);
+  free(slots);
+  free(heap);
 
-  return r*rev;
+  CHECKIOERR(fout, "writing output");
+  return r;
 }
 
-static void /* sort the linepos array */
-sortlines(struct lines *plines)
+/* -C: check that fin is sorted (strictly, with -u), comparing each
+   line with the one before, as the merge does, so only two lines
+   are in memory; stop at the first line out of order: report it
+   and return 1 */
+static int
+checksorted(FILE *fin, const char *name)
 {
-  size_t nlines = countlines(plines);
-  if (nlines > 0) {
-    size_t lo = 0, hi = nlines-1;
-    quick(plines->linepos, lo, hi, plines->linebuf);
+  char *line[2] = { 0, 0 }, *key[2] = { 0, 0 };
+  size_t keysize[2] = { 0, 0 }, lineno;
+  uint64_t prefix[2];
+  int cur = 0, prev, c, r = SUCCESS;
+  double t0 = now();
+
+  for (lineno = 1; appendline(&line[cur], fin) > 0; lineno++) {
+    const char *k = line[cur];
+    if (decorate) {
+      if (setkey(&key[cur], &keysize[cur], line[cur]) < 0) nomem();
+      k = key[cur];
+    }
+    prefix[cur] = keyprefix(k);
+    if (lineno > 1) {
+      prev = !cur;
+      COUNTCMP();
+      if (prefix[prev] != prefix[cur]) { /* as in itemcmp() */
+        c = prefix[prev] < prefix[cur] ? -1 : 1;
+        if (reverse && !numeric) c = -c;
+      }
+      else if (decorate)
+        c = keyedcmp(key[prev], line[prev], key[cur], line[cur]);
+      else c = compare(line[prev], line[cur]);
+      if (c > 0 || (unique && samekey(decorate ? key[prev] : line[prev], k))) {
+        fprintf(stderr, "%s: %s:%zu: disorder: %s", me, name, lineno, line[cur]);
+        r = 1;
+        break;
+      }
+    }
+    cur = !cur;
+    truncline(&line[cur]);
   }
-}
+  if (ferror(fin)) {
+    error("error reading %s", name);
+    r = FAILSOFT;
+  }
+  addtime(&stats.readtime, t0);
 
-/* Temp file housekeeping */
+  for (cur = 0; cur < 2; cur++) {
+    freeline(&line[cur]);
+    free(key[cur]);
+  }
+  return r;
+}
 
-/* generate name of temp file 'num' in given buffer */
-static void nametemp(char *buf, size_t len, int num)
+/* merge the presorted files (stdin if none) to fout, streaming:
+   all of them at once, so there are no temp files, and memory is
+   just an input buffer per file (within the budget if -S) */
+static int
+mergefiles(int nfiles, char **paths, FILE *fout)
 {
-  const char *p;
-  p = getenv("TMPDIR");
-  if (!p) p = "/tmp";
-  size_t n = snprintf(buf, len, "%s/sort%04d.tmp", p, num);
-  assert(n < len); /* too long for given buffer */
+  long maxfd = sysconf(_SC_OPEN_MAX);
+  int i, n = MAX(nfiles, 1), r = SUCCESS;
+  size_t bufsize = mergebufsize(n, budget > 0 ? budget : (size_t) n * MERGEBUFMAX);
+  FILE **fps;
+
+  if (maxfd > 0 && n > maxfd - FDRESERVE) {
+    error("cannot merge more than %ld files", maxfd - FDRESERVE);
+    return FAILHARD;
+  }
+  if (!(fps = calloc(n, sizeof(*fps)))) nomem();
+
+  for (i = 0; i < n; i++) {
+    if (!(fps[i] = openin(nfiles > 0 ? paths[i] : 0))) {
+      r = FAILSOFT;
+      goto done;
+    }
+    setvbuf(fps[i], 0, _IOFBF, bufsize);
+  }
+
+  if (startout(fout) < 0) {
+    r = FAILSOFT;
+    goto done;
+  }
+  double t0 = now(), w0 = stats.writetime;
+  switch (merge(fps, n, fout, TEXTIN|TEXTOUT)) {
+    case RUNNOMEM: nomem(); break;
+    case RUNERR: r = FAILSOFT; break;
+  }
+  addtime(&stats.mergetime, t0);
+  stats.mergetime -= stats.writetime - w0; /* timed by puttext() */
+  for (i = 0; i < n; i++)
+    if (ferror(fps[i])) {
+      error("error reading %s", nfiles > 0 ? paths[i] : "stdin");
+      r = FAILSOFT;
+    }
+  if (ferror(fout)) {
+    error("error writing output");
+    r = FAILSOFT;
+  }
+
+done:
+  for (i = 0; i < n; i++)
+    if (fps[i] && fps[i] != stdin)
+      fclose(fps[i]);
+  free(fps);
+  return r;
 }
 
-/* assume temp file 'num' does not exist and create it */
-static FILE *maketemp(int num)
+/* make readlines() stop when the chunk will take about 'bytes' of
+   memory while being sorted: besides its text, each line costs a
+   linepos entry and an index item (and another one with -j, for
+   merging); -d/-f keys take about as much memory as the text */
+static void
+setlimit(struct lines *plines, size_t bytes)
 {
-  char buf[PATHBUFLEN];
-  nametemp(buf, sizeof buf, num);
-  FILE *fp = fopen(buf, "w");
-  if (!fp) error("cannot create file %s", buf);
-  return fp;
+  size_t overhead = sizeof(size_t) + sizeof(struct item) * (jobs > 1 ? 2 : 1);
+  if (decorate) { /* count the text twice */
+    overhead += sizeof(char *);
+    plines->chunksize = MAX(bytes / 2, 1);
+    plines->overhead = overhead / 2;
+  }
+  else {
+    plines->chunksize = MAX(bytes, 1);
+    plines->overhead = overhead;
+  }
 }
 
-/* assume temp file 'num' exists and open it for reading */
-static FILE *opentemp(int num)
+/* sort externally, given the first chunk of input (read by memsort()
+   with the whole budget), or no lines (-c); with -D by distribution,
+   else by merging runs */
+static int
+extsort(struct lines *plines, FILE *fin, FILE *fout)
 {
-  char buf[PATHBUFLEN];
-  nametemp(buf, sizeof buf, num);
-  FILE *fp = fopen(buf, "r");
-  if (!fp) error("cannot open file %s", buf);
-  return fp;
+  bool bigchunk = countlines(plines) > 0;
+  double t0;
+  int r;
+
+  if (!bigchunk) {
+    /* -c: read the first chunk; if it is all, no temp files */
+    t0 = now();
+    r = readlines(plines, fin);
+    if (r > 0 && ateof(fin)) r = 0;
+    CHECKIOERR(fin, "reading input");
+    addtime(&stats.readtime, t0);
+    if (r == 0) {
+      size_t linebuf, linepos;
+      sizelines(plines, &linebuf, &linepos);
+      notemem(linebuf, linepos);
+      return sortout(plines, fout);
+    }
+  }
+
+  if (makespill() < 0) return FAILSOFT;
+  if (distribute)
+    return distsort(plines, fin, fout, bigchunk);
+  return runsort(plines, fin, fout, bigchunk);
 }
 
-/* assume temp file 'num' exists and delete it */
-static void droptemp(int num)
+/* sort by merging runs, the first one being the chunk in plines;
+   with -S, the budget is shared by the NCHUNKS chunks of the run
+   pipeline, and later by the merge buffers; with -c only, the merge
+   buffers take about as much memory as one chunk; the final merge
+   writes the output itself, so the data is written to temp files
+   and read back once if there are few runs */
+static int
+runsort(struct lines *plines, FILE *fin, FILE *fout, bool bigchunk)
 {
-  char buf[PATHBUFLEN];
-  nametemp(buf, sizeof buf, num);
-  int r = remove(buf);
-  if (r < 0) error("error deleting file %s", buf);
+  int lo = 0, hi, nruns, order, width = 1, merges = 0, passes = 0, first = 0, r;
+  size_t mergebudget = budget > 0 ? budget : plines->chunksize;
+  FILE *outfile, *infile;
+  double t0;
+
+  /* make the first chunk run 0; if memsort() read it with the
+     whole budget, free it before continuing with smaller chunks */
+  if (sortlines(plines) < 0) nomem();
+  t0 = now();
+  if (!(outfile = maketemp(0))) return FAILSOFT;
+  if (writerun(plines, outfile) < 0) nomem();
+  CHECKIOERR(outfile, "writing temp file");
+  fclose(outfile);
+  addtime(&stats.spilltime, t0);
+  if (bigchunk) {
+    freelines(plines);
+    setlimit(plines, budget / NCHUNKS);
+  }
+  first = 1;
+
+  if ((r = makeruns(plines, fin, first)) < 0) return FAILSOFT;
+  nruns = r;
+  hi = nruns-1;
+
+  /* the final merge takes up to 'order' runs; if there are more,
+     passes of merges combine the first runs (FIFO) until 'order'
+     runs remain; the merges of a pass are independent, so up to
+     'width' of them run at once, each with its share of the open
+     files and of the memory budget */
+  t0 = now();
+  order = mergeorder(nruns, mergebudget, 1);
+  if (nruns > order) {
+    width = mergewidth(nruns, mergebudget);
+    int group = mergeorder(nruns, mergebudget, width);
+    struct mergejob *mjobs = malloc((nruns/2 + 1) * sizeof(*mjobs));
+    if (!mjobs) nomem();
+    while (hi-lo+1 > order) {
+      int need = hi-lo+1 - order; /* runs to get rid of */
+      int next = lo, out = hi+1, njobs = 0;
+      while (need > 0) {
+        int k = MIN(MIN(group, need+1), hi+1 - next);
+        if (k < 2) break;
+        mjobs[njobs].lo = next;
+        mjobs[njobs].hi = next+k-1;
+        mjobs[njobs].out = out++;
+        mjobs[njobs].bufsize = mergebufsize(k, mergebudget / width);
+        njobs++;
+        next += k;
+        need -= k-1;
+      }
+      if ((r = runmerges(mjobs, njobs, width)) == RUNNOMEM) nomem();
+      if (r < 0) {
+        free(mjobs);
+        return FAILSOFT;
+      }
+      lo = next;
+      hi = out-1;
+      merges += njobs;
+      passes += 1;
+    }
+    free(mjobs);
+  }
+  if (startout(fout) < 0) return FAILSOFT;
+  if (lo < hi) { /* the final merge, to fout */
+    double w0 = stats.writetime;
+    r = domerge(lo, hi, 0, fout, mergebufsize(hi-lo+1, mergebudget));
+    if (r == RUNNOMEM) nomem();
+    if (r < 0) return FAILSOFT;
+    merges += 1;
+    passes += 1;
+    addtime(&stats.mergetime, t0);
+    stats.mergetime -= stats.writetime - w0; /* timed by puttext() */
+  }
+  else { /* a single run */
+    addtime(&stats.mergetime, t0);
+    t0 = now();
+    infile = opentemp(hi);
+    r = copyrun(infile, fout);
+    CHECKIOERR(infile, "reading temp file");
+    fclose(infile);
+    droptemp(hi);
+    if (r < 0) return FAILSOFT;
+    CHECKIOERR(fout, "writing output");
+    addtime(&stats.writetime, t0);
+  }
+  stats.passes += passes;
+
+  if (verbosity > 0 && !distribute) /* else it is one bucket */
+    fprintf(stderr, "(external sorting used %d runs, chunk size = %zd, "
+    "merge order = %d, merges = %d, passes = %d, merge threads = %d)\n",
+    nruns, plines->chunksize, order, merges, passes, width);
+  if (verbosity > 0 && compress)
+    packstats();
+
+  return SUCCESS;
 }
 
-/* assume temp files lo..hi exist and open them for reading */
-static void opentemps(FILE **fps, int lo, int hi)
+/* memory per run when merging, besides its input buffer */
+#define RUNMEM (BLOCKSIZE + (compress ? LZ_BOUND(BLOCKSIZE) : 0))
+#define MINORDER 5 /* merge order at least, with -c only (no budget) */
+
+/* choose how many runs to merge at once: all of them if possible,
+   but limited by the number of files we may open and by the memory
+   budget (at least MERGEBUFMIN bytes of input buffer per run), both
+   shared by nmerges merges running at the same time; with -c only,
+   mem is the chunk size, which bounds the runs, not the merge, so
+   it does not push the order below MINORDER */
+static int
+mergeorder(int nruns, size_t mem, int nmerges)
 {
-  int num;
-  for (num = lo; num <= hi; num++) {
-    fps[num-lo] = opentemp(num);
+  long maxfd = sysconf(_SC_OPEN_MAX);
+  long order = nruns;
+
+  if (mem > 0) {
+    long n = (long) (mem / nmerges / (MERGEBUFMIN + RUNMEM));
+    order = MIN(order, budget > 0 ? n : MAX(n, MINORDER));
   }
+  if (maxfd > 0)
+    order = MIN(order, (maxfd - FDRESERVE - (nmerges-1)) / nmerges);
+
+  return (int) MAX(order, 2);
 }
 
-/* close and delete temp flies lo..hi */
-static void droptemps(FILE **fps, int lo, int hi)
+/* number of passes to merge nruns runs k at a time, until
+   no more than 'order' runs are left for the final merge */
+static int
+mergepasses(int nruns, int order, int k)
 {
-  int num;
-  for (num = lo; num <= hi; num++) {
-    fclose(fps[num-lo]);
-    droptemp(num);
-  }
+  int passes = 0;
+  for (; nruns > order; passes++)
+    nruns = (nruns + k-1) / k;
+  return passes;
 }
 
-/* Merging */
+/* how many merges may run at once: up to iojobs, but sharing the
+   files and memory must not make for more passes over the data */
+static int
+mergewidth(int nruns, size_t mem)
+{
+  int order = mergeorder(nruns, mem, 1);
+  int passes = mergepasses(nruns, order, order);
+  int width = iojobs;
 
-struct run {
-  FILE *fp;
-  char *lp;
-};
+  while (width > 1 &&
+    mergepasses(nruns, order, mergeorder(nruns, mem, width)) > passes)
+    width--;
+  return width;
+}
 
-static int mergecmp(int i, int j, void *userdata)
+/* input buffer size per run when merging k runs */
+static size_t
+mergebufsize(int k, size_t mem)
 {
-  struct run *mergebuf = userdata;
-  const char *s = mergebuf[i].lp;
-  const char *t = mergebuf[j].lp;
-  return compare(s, t);
+  size_t size = mem / k > RUNMEM ? mem / k - RUNMEM : 0;
+  return MAX(MERGEBUFMIN, MIN(size, MERGEBUFMAX));
 }
 
-static void merge(FILE *infps[], int numfp, FILE *outfp)
+/* merge temp files lo..hi into temp file 'out', or as text into
+   fout if not null, and delete them; may run in a thread (with
+   fout null): return 0, RUNERR (reported) or RUNNOMEM */
+static int
+domerge(int lo, int hi, int out, FILE *fout, size_t bufsize)
 {
-  struct run mergebuf[MERGEORDER];
-  int heap[1+MERGEORDER]; /* indices into mergebuf; heap[0] unused */
-  int n = 0; /* number of heap entries */
+  int i, k = hi-lo+1, r = 0;
+  FILE **fps, *outfp = fout;
 
-  for (int i = 0; i < numfp; i++) {
-    FILE *fp = infps[i];
-    char *lp = 0;
-    size_t len = appendline(&lp, fp);
-    if (len > 0) {
-      mergebuf[n].fp = fp;
-      mergebuf[n].lp = lp;
-      heap[1+n] = n;
-      n += 1;
-    }
+  if (!(fps = calloc(k, sizeof(*fps)))) return RUNNOMEM;
+  opentemps(fps, lo, hi);
+  for (i = 0; i < k; i++) {
+    if (!fps[i]) r = RUNERR;
+    else setvbuf(fps[i], 0, _IOFBF, bufsize);
   }
+  if (r == 0 && !fout && !(outfp = maketemp(out))) r = RUNERR;
+  if (r == 0) {
+    r = merge(fps, k, outfp, fout ? TEXTOUT : 0);
+    if (ferror(outfp) && r == 0)
+      r = RUNERR, error(fout ? "error writing output" : "error writing temp file");
+    if (!fout) fclose(outfp);
+    for (i = 0; i < k; i++)
+      if (ferror(fps[i]) && r == 0) r = RUNERR, error("error merging");
+  }
+  droptemps(fps, lo, hi);
+  free(fps);
+  return r;
+}
 
-  /* a fully sorted array is also a heap */
-  quicksort(&heap[1], n, mergecmp, mergebuf);
+struct mergepool {
+  pthread_mutex_t mutex;
+  struct mergejob *jobs;
+  int njobs;
+  int next; /* next job to take */
+  int err;  /* first error, stops the pool */
+};
 
-  while (n > 0) {
-    FILE *fp = mergebuf[heap[1]].fp;
-    char *lp = mergebuf[heap[1]].lp;
-    fputs(lp, outfp);
-    truncline(&lp);
-    size_t len = appendline(&lp, fp);
-    if (len > 0) {
-      mergebuf[heap[1]].lp = lp;
-    }
-    else { /* one less input file */
-      freeline(&lp);
-      heap[1] = heap[n];
-      n -= 1;
+static void *
+mergeworker(void *arg)
+{
+  struct mergepool *pp = arg;
+  struct mergejob *jp;
+  int r;
+
+  for (;;) {
+    pthread_mutex_lock(&pp->mutex);
+    jp = pp->err || pp->next >= pp->njobs ? 0 : &pp->jobs[pp->next++];
+    pthread_mutex_unlock(&pp->mutex);
+    if (!jp) break;
+    r = domerge(jp->lo, jp->hi, jp->out, 0, jp->bufsize);
+    if (r < 0) {
+      pthread_mutex_lock(&pp->mutex);
+      if (!pp->err) pp->err = r;
+      pthread_mutex_unlock(&pp->mutex);
     }
-    reheap(heap, n, mergecmp, mergebuf);
   }
+  return 0;
 }
 
-/* Sorting algorithm */
+/* run the merges of a pass, up to nthreads at once (the calling
+   thread is one of them); return 0 or the first error */
+static int
+runmerges(struct mergejob *mjobs, int njobs, int nthreads)
+{
+  int i, n = MIN(nthreads, njobs);
+  pthread_t threads[MAXJOBS];
+  bool started[MAXJOBS];
+  struct mergepool pool;
 
-static void swap(size_t *v, size_t i, size_t j);
-static int linecmp(const size_t *v, size_t i, size_t j, const char *linebuf);
+  pthread_mutex_init(&pool.mutex, 0);
+  pool.jobs = mjobs;
+  pool.njobs = njobs;
+  pool.next = 0;
+  pool.err = 0;
 
-static void
-quick(size_t *v, size_t lo, size_t hi, const char *linebuf)
+  for (i = 1; i < n; i++)
+    started[i] = pthread_create(&threads[i], 0, mergeworker, &pool) == 0;
+  mergeworker(&pool);
+  for (i = 1; i < n; i++)
+    if (started[i]) pthread_join(threads[i], 0);
+
+  pthread_mutex_destroy(&pool.mutex);
+  return pool.err;
+}
+
+/* Numbers (-n): an optional sign, digits, and an optional fraction,
+   like -12.50; they are compared exactly, whatever their size; and
+   for sorting, numkey() maps each to a 64-bit key, which preserves
+   their order: the sign, the number of integer digits, and the first
+   NUMDIGITS significant digits (so numbers that differ only later,
+   or have more than 63 integer digits, get equal keys) */
+
+#define NUMDIGITS 17 /* < 2^57 */
+#define NUMEXP 57    /* bits 57..62: number of integer digits */
+#define NONUM UINT64_MAX /* numkey() of a line without a number */
+
+struct num {
+  const char *ip;   /* integer digits, without leading zeros */
+  size_t nint;
+  const char *fp;   /* fraction digits, without trailing zeros */
+  size_t nfrac;
+  bool neg;         /* less than zero */
+};
+
+/* scan a number at s; return #chars scanned, 0 if there is none */
+static size_t
+scannum(const char *s, struct num *np)
+{
+  const char *p = s, *q;
+  bool neg = false;
+
+  if (*p == '-' || *p == '+') neg = *p++ == '-';
+  q = p;
+  while (*p == '0') p++;
+  np->ip = p;
+  while (isdigit((unsigned char) *p)) p++;
+  np->nint = p - np->ip;
+  np->fp = p;
+  np->nfrac = 0;
+  if (*p == '.' && isdigit((unsigned char) p[1])) {
+    np->fp = ++p;
+    while (isdigit((unsigned char) *p)) p++;
+    np->nfrac = p - np->fp;
+    while (np->nfrac > 0 && np->fp[np->nfrac-1] == '0') np->nfrac--;
+  }
+  else if (p == q) return 0; /* no digits */
+  np->neg = neg && (np->nint > 0 || np->nfrac > 0); /* -0 is 0 */
+  return p - s;
+}
+
+static int /* compare numbers scanned by scannum() */
+numcmp(const struct num *a, const struct num *b)
 {
-  size_t i, lim;
+  size_t n = MIN(a->nfrac, b->nfrac);
+  int r;
 
-  if (lo >= hi) return;    /* nothing to sort */
+  if (a->neg != b->neg) return a->neg ? -1 : 1;
+  if (a->nint != b->nint) r = a->nint < b->nint ? -1 : 1;
+  else if (!(r = memcmp(a->ip, b->ip, a->nint)) && !(r = memcmp(a->fp, b->fp, n)))
+    r = a->nfrac < b->nfrac ? -1 : a->nfrac > b->nfrac;
+  return a->neg ? -r : r;
+}
 
-  swap(v, lo, (lo+hi)/2);  /* move middle elem as pivot to v[lo] */
-  lim = lo;                /* invariant: v[lo..lim-1] < pivot */
-  for (i = lo+1; i <= hi; i++)
-    if (linecmp(v, i, lo, linebuf) < 0) /* if v[i] < pivot... */
-      swap(v, ++lim, i);   /* ...swap it into left subset */
-  swap(v, lo, lim);        /* restore pivot, NB v[lim] <= v[lo] */
+/* order-preserving key of the number at s (after blanks), NONUM if
+   there is none; with -r, the keys of numbers are reversed, so that
+   ascending keys are in output order, and NONUM stays last */
+static uint64_t
+numkey(const char *s)
+{
+  struct num x;
+  uint64_t mag = 0, key;
+  size_t i, exp;
 
-  if (lim-lo < hi-lim) {   /* recurse smaller subset first */
-    if (lim > 0) quick(v, lo, lim-1, linebuf);
-    quick(v, lim+1, hi, linebuf);
-  } else {
-    quick(v, lim+1, hi, linebuf);
-    if (lim > 0) quick(v, lo, lim-1, linebuf);
+  if (scannum(s + scanspace(s), &x) == 0) return NONUM;
+  exp = x.nint;
+  if (exp > (1 << (63-NUMEXP)) - 1) { /* saturate */
+    exp = (1 << (63-NUMEXP)) - 1;
+    for (i = 0; i < NUMDIGITS; i++) mag = 10*mag + 9;
+  }
+  else for (i = 0; i < NUMDIGITS; i++) {
+    int c = i < x.nint ? x.ip[i] : i-x.nint < x.nfrac ? x.fp[i-x.nint] : '0';
+    mag = 10*mag + (c - '0');
   }
-  /* NB size_t is unsigned: watch for lim-1 wrapping around! */
+  mag |= (uint64_t) exp << NUMEXP;
+  key = x.neg ? (UINT64_C(1) << 63) - 1 - mag : (UINT64_C(1) << 63) | mag;
+  return reverse ? NONUM - 1 - key : key;
 }
 
-static void
-swap(size_t *v, size_t i, size_t j)
+/* dictionary sort: any non-alnum is a separator */
+#define ISSEP(c) (c && !isalnum(c))
+#define SKIPSEP(s) while (ISSEP(*s)) ++s
+
+/* next char of dictionary key: a run of separators is one blank,
+   but a trailing run is dropped (leading runs are skipped by caller) */
+static int
+dictchar(const unsigned char **pp)
 {
-  size_t t = v[i];
-  v[i] = v[j];
-  v[j] = t;
+  const unsigned char *p = *pp;
+  if (ISSEP(*p)) {
+    SKIPSEP(p);
+    *pp = p;
+    return *p ? ' ' : 0;
+  }
+  if (*p) *pp = p+1;
+  return *p;
 }
 
+/* total order on lines: if the keys compare equal, fall back
+   to plain byte order, so only identical lines compare equal;
+   thus the output does not depend on the sorting algorithm */
 static int
-linecmp(const size_t *v, size_t i, size_t j, const char *linebuf)
+compare(const char *s, const char *t)
 {
-  const char *s = linebuf + v[i];
-  const char *t = linebuf + v[j];
-  return compare(s, t);
+  int r = keycmp(s, t);
+  if (r == 0 && (numeric || dictsort || casefold)) {
+    r = strcmp(s, t);
+    if (reverse) r = -r;
+  }
+  return r;
 }
 
-/* Options and usage */
+/* compare lines (or keys) given with their keys (made by makekey()):
+   like compare(), but the keys are compared only as needed after
+   makekey(), so -d and -f are not applied again */
+static int
+keyedcmp(const char *sk, const char *s, const char *tk, const char *t)
+{
+  int r;
+  if (numeric) { /* keys are fields as is */
+    if ((r = keycmp(sk, tk))) return r;
+  }
+  else if ((r = strcmp(sk, tk))) return reverse ? -r : r;
+  r = strcmp(s, t);
+  return reverse ? -r : r;
+}
+
+/* -u: are the lines equal under the sort options? s and t are
+   the keys (made by makekey()) if decorate, else the lines */
+static bool
+samekey(const char *s, const char *t)
+{
+  return (decorate && !numeric ? strcmp(s, t) : keycmp(s, t)) == 0;
+}
 
+/* compare lines according to the sort options */
 static int
-parseopts(int argc, char **argv, size_t *chunksize)
+keycmp(const char *s, const char *t)
 {
-  long l;
-  int i, showhelp = 0;
+  int r, rev = reverse ? -1 : 1;
 
-  for (i = 1; i < argc && argv[i]; i++) {
-    const char *p = argv[i];
-    if (*p != '-' || streq(p, "-")) break; /* no more option args */
-    if (streq(p, "--")) { ++i; break; } /* end of option args */
-    for (++p; *p; p++) {
-      switch (*p) {
-        case 'd': dictsort = true; break;
-        case 'f': casefold = true; break;
+  if (numeric) {
+    /* compare numeric prefix; ignore leading space */
+    /* lines w/o numeric prefix always sort at the end */
+    struct num x, y;
+    s += scanspace(s);
+    t += scanspace(t);
+    size_t m = scannum(s, &x);
+    size_t n = scannum(t, &y);
+    if (m > 0 && n > 0) {
+      if ((r = numcmp(&x, &y))) return r*rev;
+      s += m; t += n;
+    }
+    else if (m > 0) return -1;
+    else if (n > 0) return +1;
+    /* numeric prefix equal (or both missing) */
+  }
+
+  if (dictsort) {
+    const unsigned char *ss = (void *) s;
+    const unsigned char *tt = (void *) t;
+    SKIPSEP(ss); SKIPSEP(tt);
+    do {
+      int c = dictchar(&ss), d = dictchar(&tt);
+      r = casefold ? tolower(c) - tolower(d) : c - d;
+      if (c == 0 || d == 0) break;
+    } while (r == 0);
+  }
+  else if (casefold) {
+    const unsigned char *ss = (void *) s;
+    const unsigned char *tt = (void *) t;
+    while (*ss && *tt && (*ss == *tt || tolower(*ss) == tolower(*tt))) ++ss, ++tt;
+    r = tolower(*ss) - tolower(*tt);
+  }
+  else r = strcmp(s, t);
+
+  return r*rev;
+}
+
+/* leading key bytes of s as a big-endian number, or with -n the
+   numkey(): comparing prefixes agrees with keycmp() unless the
+   prefixes are equal (numeric prefixes already include -r) */
+static uint64_t
+keyprefix(const char *s)
+{
+  const unsigned char *p = (void *) s;
+  uint64_t prefix = 0;
+  int i, c;
+
+  if (numeric) return numkey(s);
+
+  for (i = 0; i < 8; i++) {
+    if ((c = *p)) ++p;
+    prefix = prefix << 8 | (uint64_t) c;
+  }
+  return prefix;
+}
+
+/* find the -k fields of line s: fields are separated by the -t
+   character, or else by runs of blanks (leading blanks are not part
+   of a field); return the start of the key and set *pend to its end
+   (the key is empty if the line has too few fields) */
+static const char *
+keyspan(const char *s, const char **pend)
+{
+  const char *p = s, *beg = 0;
+  int field;
+
+  for (field = 1; ; field++) {
+    if (blanksep) p += strspn(p, " \t");
+    if (field == keybeg) beg = p;
+    p += strcspn(p, fieldseps);
+    if (field == keyend || *p == '\n' || *p == 0) break;
+    p += 1; /* skip the separator */
+  }
+  if (!beg) beg = p;
+  if (keyend == 0) p += strcspn(p, "\n");
+  *pend = p;
+  return beg;
+}
+
+/* write the key of line s to k, return its length: the -k fields
+   (or the whole line) with -d/-f applied, but as is with -n, which
+   parses the key when comparing */
+static size_t
+makekey(char *k, const char *s)
+{
+  const unsigned char *p;
+  unsigned char *q;
+  const char *e;
+  size_t n;
+  int c;
+
+  if (keybeg > 0) s = keyspan(s, &e);
+  else e = s + strlen(s);
+  n = e - s;
+  memcpy(k, s, n);
+  k[n] = 0;
+  if (numeric || !(dictsort || casefold)) return n;
+
+  p = q = (void *) k; /* in place: the key only gets shorter */
+  if (dictsort) {
+    SKIPSEP(p);
+    while ((c = dictchar(&p)))
+      *q++ = casefold ? tolower(c) : c;
+  }
+  else while ((c = *p++))
+    *q++ = tolower(c);
+  *q = 0;
+
+  return q - (unsigned char *) k;
+}
+
+/* make the key of line s in *pbuf (a malloc'd buffer of *psize
+   bytes, grown as needed); return -1 if out of memory */
+static int
+setkey(char **pbuf, size_t *psize, const char *s)
+{
+  if (reserve(pbuf, psize, strlen(s) + 1) < 0) return -1;
+  makekey(*pbuf, s);
+  return 0;
+}
+
+/* line of a key in the key arena (stored just before the key) */
+static const char *
+keyline(const char *key)
+{
+  const char *s;
+  memcpy(&s, key - sizeof(s), sizeof(s));
+  return s;
+}
+
+static int /* sort the linepos array, -1 if out of memory */
+sortlines(struct lines *plines)
+{
+  size_t i, nlines = countlines(plines);
+  const char *linebuf = plines->linebuf;
+  char *keybuf = 0;
+  struct item *v;
+  double t0 = now();
+
+  if (nlines < 2) return 0;
+
+  /* build the index: the prefixes are contiguous in memory,
+     so most comparisons need not touch the lines at all;
+     NB may run in a thread: report, don't call nomem() */
+  v = malloc(nlines * sizeof(*v));
+  if (!v) return -1;
+
+  if (decorate) {
+    /* compute each key once into an arena, preceded by
+       a pointer to its line, and sort the keys instead */
+    size_t len = countbytes(plines) + nlines * sizeof(char *);
+    char *k = keybuf = malloc(len);
+    if (!keybuf) { free(v); return -1; }
+    for (i = 0; i < nlines; i++) {
+      const char *s = linebuf + plines->linepos[i];
+      memcpy(k, &s, sizeof(s));
+      k += sizeof(s);
+      v[i].pos = k - keybuf;
+      k += makekey(k, s) + 1;
+      v[i].prefix = keyprefix(keybuf + v[i].pos);
+    }
+    linebuf = keybuf;
+  }
+  else for (i = 0; i < nlines; i++) {
+    v[i].pos = plines->linepos[i];
+    v[i].prefix = keyprefix(linebuf + v[i].pos);
+  }
+
+  if (jobs > 1 && nlines >= 2*PARMIN)
+    psort(v, nlines, linebuf, jobs);
+  else sortitems(v, nlines, linebuf);
+
+  if (unique) { /* keep the first of equal items */
+    size_t n = 1;
+    for (i = 1; i < nlines; i++)
+      if (v[i].prefix != v[n-1].prefix ||
+          !samekey(linebuf + v[i].pos, linebuf + v[n-1].pos))
+        v[n++] = v[i];
+    trunclines(plines, nlines = n);
+  }
+
+  if (decorate) {
+    for (i = 0; i < nlines; i++)
+      plines->linepos[i] = keyline(keybuf + v[i].pos) - plines->linebuf;
+    free(keybuf);
+  }
+  else for (i = 0; i < nlines; i++)
+    plines->linepos[i] = v[i].pos;
+  free(v);
+  addtime(&stats.sorttime, t0);
+  return 0;
+}
+
+/* Pipelined run generation: this thread reads chunks of input,
+   a sorter thread sorts them, and a writer thread writes them to
+   temp files, all at the same time on different chunks, so run
+   generation proceeds at the pace of the slowest stage; chunks
+   cycle through the lists free -> filled -> sorted -> free, so
+   there are never more than NCHUNKS chunks in memory; reading
+   stays in this thread because out of memory is handled by
+   longjmp, which must not happen in another thread; makeruns()
+   catches it and stops the other threads before passing it on */
+
+struct chunk {
+  struct lines lines;
+  struct chunk *next;
+};
+
+struct pipeline {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;    /* broadcast on every change */
+  struct chunk *free;     /* chunks available for reading */
+  struct chunk *filled;   /* chunks read but not yet sorted */
+  struct chunk *sorted;   /* chunks sorted but not yet written */
+  bool eof;               /* all input has been read */
+  bool sorted_all;        /* the sorter has finished */
+  bool failed;            /* some stage failed: stop */
+  bool nomem;             /* ...because out of memory */
+  int nruns;              /* number of runs written */
+};
+
+static void append(struct chunk **list, struct chunk *cp);
+static struct chunk *pop(struct chunk **list);
+static void *sorter(void *arg);
+static void *writer(void *arg);
+static void readchunks(struct pipeline *pp, FILE *fin);
+static bool readcaught(struct pipeline *pp, FILE *fin);
+
+/* read, sort, and write runs first, first+1, ...;
+   return #runs (including those before first) or -1 on error */
+static int
+makeruns(struct lines *plines, FILE *fin, int first)
+{
+  struct pipeline pl;
+  struct chunk chunks[NCHUNKS];
+  pthread_t sortthread, writethread;
+  bool readnomem;
+  size_t linebuf = 0, linepos = 0;
+  int i;
+
+  memset(&pl, 0, sizeof(pl));
+  pl.nruns = first;
+  pthread_mutex_init(&pl.mutex, 0);
+  pthread_cond_init(&pl.cond, 0);
+
+  for (i = 0; i < NCHUNKS; i++) {
+    memset(&chunks[i], 0, sizeof(chunks[i])); /* zero-init for buf.h */
+    chunks[i].lines.chunksize = plines->chunksize;
+    chunks[i].lines.overhead = plines->overhead;
+    append(&pl.free, &chunks[i]);
+  }
+  chunks[0].lines = *plines; /* reuse the caller's buffers */
+
+  if (pthread_create(&sortthread, 0, sorter, &pl)) {
+    error("cannot create sorter thread");
+    return -1;
+  }
+  if (pthread_create(&writethread, 0, writer, &pl)) {
+    error("cannot create writer thread");
+    pthread_mutex_lock(&pl.mutex);
+    pl.failed = true;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.mutex);
+    pthread_join(sortthread, 0);
+    return -1;
+  }
+
+  readnomem = readcaught(&pl, fin);
+
+  pthread_mutex_lock(&pl.mutex);
+  if (readnomem) pl.failed = true;
+  pl.eof = true;
+  pthread_cond_broadcast(&pl.cond);
+  pthread_mutex_unlock(&pl.mutex);
+
+  pthread_join(sortthread, 0);
+  pthread_join(writethread, 0);
+  pthread_cond_destroy(&pl.cond);
+  pthread_mutex_destroy(&pl.mutex);
+
+  for (i = 0; i < NCHUNKS; i++) { /* capacity only grows */
+    size_t b, p;
+    sizelines(&chunks[i].lines, &b, &p);
+    linebuf += b;
+    linepos += p;
+  }
+  notemem(linebuf, linepos);
+
+  *plines = chunks[0].lines; /* caller frees this one */
+  for (i = 1; i < NCHUNKS; i++)
+    freelines(&chunks[i].lines);
+
+  if (readnomem) longjmp(errjmp, 1); /* reported by nomem() */
+  if (pl.nomem) nomem();
+  return pl.failed ? -1 : pl.nruns;
+}
+
+/* nomem() in readlines() would longjmp past the threads, which
+   still use the pipeline and the temp files: run readchunks() with
+   errjmp set here, and return true if it caught nomem(), so that
+   makeruns() passes it on once they are joined (in a function of
+   its own, so no locals of makeruns() are live across setjmp) */
+static bool
+readcaught(struct pipeline *pp, FILE *fin)
+{
+  jmp_buf mainjmp;
+  bool caught;
+
+  memcpy(mainjmp, errjmp, sizeof(errjmp));
+  if (setjmp(errjmp) == 0) {
+    readchunks(pp, fin);
+    caught = false;
+  }
+  else caught = true;
+  memcpy(errjmp, mainjmp, sizeof(errjmp));
+  return caught;
+}
+
+/* the reading stage of makeruns(): fill free chunks from fin until
+   the input ends or a stage fails; an empty last chunk is skipped
+   (the input is not empty: run 0 came before) */
+static void
+readchunks(struct pipeline *pp, FILE *fin)
+{
+  int r;
+
+  do {
+    struct chunk *cp;
+    pthread_mutex_lock(&pp->mutex);
+    while (!pp->free && !pp->failed)
+      pthread_cond_wait(&pp->cond, &pp->mutex);
+    cp = pp->failed ? 0 : pop(&pp->free);
+    pthread_mutex_unlock(&pp->mutex);
+    if (!cp) break;
+
+    double t0 = now();
+    clearlines(&cp->lines);
+    r = readlines(&cp->lines, fin);
+    addtime(&stats.readtime, t0);
+
+    pthread_mutex_lock(&pp->mutex);
+    if (ferror(fin)) {
+      error("error reading input");
+      pp->failed = true;
+    }
+    if (countlines(&cp->lines) > 0)
+      append(&pp->filled, cp);
+    else append(&pp->free, cp);
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->mutex);
+  } while (r > 0);
+}
+
+static void *
+sorter(void *arg)
+{
+  struct pipeline *pp = arg;
+  struct chunk *cp;
+
+  for (;;) {
+    pthread_mutex_lock(&pp->mutex);
+    while (!pp->filled && !pp->eof && !pp->failed)
+      pthread_cond_wait(&pp->cond, &pp->mutex);
+    cp = pp->failed ? 0 : pop(&pp->filled);
+    pthread_mutex_unlock(&pp->mutex);
+    if (!cp) break; /* end of input or failure */
+
+    int r = sortlines(&cp->lines);
+
+    pthread_mutex_lock(&pp->mutex);
+    if (r < 0) pp->failed = pp->nomem = true;
+    append(&pp->sorted, cp);
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->mutex);
+  }
+
+  pthread_mutex_lock(&pp->mutex);
+  pp->sorted_all = true;
+  pthread_cond_broadcast(&pp->cond);
+  pthread_mutex_unlock(&pp->mutex);
+  return 0;
+}
+
+static void *
+writer(void *arg)
+{
+  struct pipeline *pp = arg;
+  struct chunk *cp;
+  FILE *fp;
+
+  for (;;) {
+    pthread_mutex_lock(&pp->mutex);
+    while (!pp->sorted && !pp->sorted_all && !pp->failed)
+      pthread_cond_wait(&pp->cond, &pp->mutex);
+    cp = pp->failed ? 0 : pop(&pp->sorted);
+    pthread_mutex_unlock(&pp->mutex);
+    if (!cp) break; /* all written or failure */
+
+    bool ok = false, nomem = false;
+    double t0 = now();
+    if ((fp = maketemp(pp->nruns))) {
+      nomem = writerun(&cp->lines, fp) < 0;
+      ok = !nomem && !ferror(fp);
+      if (!ok && !nomem) error("error writing temp file");
+      fclose(fp);
+    }
+    addtime(&stats.spilltime, t0);
+
+    pthread_mutex_lock(&pp->mutex);
+    if (ok) pp->nruns += 1;
+    else pp->failed = true;
+    if (nomem) pp->nomem = true;
+    append(&pp->free, cp);
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->mutex);
+  }
+  return 0;
+}
+
+static void /* append chunk at end of list */
+append(struct chunk **list, struct chunk *cp)
+{
+  while (*list) list = &(*list)->next;
+  cp->next = 0;
+  *list = cp;
+}
+
+static struct chunk * /* remove and return first chunk, if any */
+pop(struct chunk **list)
+{
+  struct chunk *cp = *list;
+  if (cp) *list = cp->next;
+  return cp;
+}
+
+/* Distribution sort (-D): splitters taken from a sample of the input
+   cut the key order into buckets that should fit into memory; one
+   pass scatters the lines into a temp file per bucket, then each
+   bucket is read back, sorted in memory (with -j threads), and
+   written out in turn, so the data goes to temp files and back
+   exactly once, however large it is; the sample is spread over the
+   whole input if it is a regular file (mapped), else it comes from
+   the first chunk; a bucket that does not fit after all (a skewed
+   sample, or many equal keys) is sorted by merging runs */
+
+#define OVERSAMPLE 64 /* sample lines per bucket */
+#define MINSAMPLE 32 /* at least, if only the first chunk is sampled */
+#define MAXBUCKETS 1024
+#define BUCKETFILL 0.7 /* aim at buckets of this part of the memory */
+
+struct splitter {
+  char *line;      /* malloc'ed */
+  char *key;       /* if decorate */
+  size_t keysize;
+  uint64_t prefix;
+};
+
+struct buckets {
+  int n;
+  struct splitter *split; /* n-1 splitters */
+  FILE **fps;             /* bucket files */
+  size_t *bytes;          /* bytes of lines in each */
+  size_t *nlines;         /* lines in each */
+  off_t *lag, *mark;      /* -N: see dropwritten() */
+  char *key;              /* of the current line, if decorate */
+  size_t keysize;
+};
+
+static void namebucket(char *buf, size_t len, int num);
+
+static int /* the sort order, for sorting the sample */
+samplecmp(int i, int j, void *userdata)
+{
+  struct splitter *v = userdata;
+  COUNTCMP();
+  if (decorate) return keyedcmp(v[i].key, v[i].line, v[j].key, v[j].line);
+  return compare(v[i].line, v[j].line);
+}
+
+/* compare the key of a line with a splitter, but not the lines,
+   so lines with equal keys go to the same bucket (for -u) */
+static int
+splitcmp(uint64_t prefix, const char *k, const struct splitter *sp)
+{
+  int r;
+
+  COUNTCMP();
+  if (prefix != sp->prefix) { /* as in itemcmp() */
+    r = prefix < sp->prefix ? -1 : 1;
+    return reverse && !numeric ? -r : r;
+  }
+  if (!decorate || numeric)
+    return keycmp(k, decorate ? sp->key : sp->line);
+  r = strcmp(k, sp->key);
+  return reverse ? -r : r;
+}
+
+static void /* append a copy of line s (len bytes) to the sample v[*pn] */
+addsample(struct splitter *v, int *pn, const char *s, size_t len)
+{
+  struct splitter *sp = &v[*pn];
+
+  if (!(sp->line = malloc(len + 2))) nomem();
+  memcpy(sp->line, s, len);
+  if (len == 0 || s[len-1] != '\n') sp->line[len++] = '\n';
+  sp->line[len] = '\0';
+  if (decorate && setkey(&sp->key, &sp->keysize, sp->line) < 0) nomem();
+  sp->prefix = keyprefix(decorate ? sp->key : sp->line);
+  *pn += 1;
+}
+
+/* sample m lines at even intervals from the rest of fin, if it
+   is a regular file, by mapping it (this touches m pages only); the
+   file is mapped anew for each sample, since the kernel maps cached
+   pages around each one touched, which for all samples together
+   would be most of the file, and count against the budget */
+static void
+samplefile(FILE *fin, struct splitter *v, int *pn, int m)
+{
+  struct stat st;
+  off_t start = ftello(fin);
+  size_t size, len;
+  char *map;
+  int j;
+
+  if (m <= 0 || start < 0 || fstat(fileno(fin), &st) < 0 ||
+      !S_ISREG(st.st_mode) || st.st_size <= start)
+    return;
+  size = st.st_size;
+  len = size - start;
+  for (j = 0; j < m; j++) {
+    map = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(fin), 0);
+    if (map == MAP_FAILED) return;
+    const char *p = map + start + (size_t) ((2*j+1) * (double) len / (2*m));
+    const char *b = p, *e;
+    while (b > map + start && b[-1] != '\n') b--; /* the line around p */
+    e = memchr(p, '\n', map + size - p);
+    e = e ? e+1 : map + size;
+    addsample(v, pn, b, e-b);
+    munmap(map, size);
+  }
+}
+
+static void /* append the lines of plines to their bucket files */
+scatter(struct lines *plines, struct buckets *bp)
+{
+  size_t i, n = countlines(plines);
+
+  for (i = 0; i < n; i++) {
+    const char *s = plines->linebuf + plines->linepos[i], *k = s;
+    int lo = 0, hi = bp->n - 1; /* the first splitter not less */
+    if (decorate) {
+      if (setkey(&bp->key, &bp->keysize, s) < 0) nomem();
+      k = bp->key;
+    }
+    uint64_t prefix = keyprefix(k);
+    while (lo < hi) {
+      int mid = lo + (hi-lo)/2;
+      if (splitcmp(prefix, k, &bp->split[mid]) <= 0) hi = mid;
+      else lo = mid+1;
+    }
+    fputs(s, bp->fps[lo]);
+    bp->bytes[lo] += strlen(s);
+    bp->nlines[lo] += 1;
+    if (nocache && bp->bytes[lo] - bp->mark[lo] >= (size_t) CACHESTEP(bp->n))
+      dropwritten(bp->fps[lo], &bp->lag[lo], &bp->mark[lo], bp->bytes[lo], false);
+  }
+}
+
+static int
+distsort(struct lines *plines, FILE *fin, FILE *fout, bool bigchunk)
+{
+  long maxfd = sysconf(_SC_OPEN_MAX);
+  size_t limit = plines->chunksize, overhead = plines->overhead;
+  size_t n = countlines(plines), bytes = countbytes(plines);
+  size_t mem = budget > 0 ? budget : limit, bufsize, used;
+  off_t rest = insize(fin);
+  struct splitter *v;
+  struct buckets bk;
+  char buf[PATHBUFLEN];
+  int i, m, ns = 0, *idx, bigs = 0, r = SUCCESS;
+  double t0;
+  FILE *fp;
+
+  /* enough buckets to split the whole input (if its size is known)
+     into pieces that fit into memory, as the first chunk did; else
+     as many as the first chunk, the only sample, can split well;
+     and no more than their buffers fit into half the memory */
+  memset(&bk, 0, sizeof(bk));
+  if (rest > 0) {
+    double total = (bytes + n * overhead) * (1 + (double) rest / bytes);
+    bk.n = (int) MIN(total / (limit * BUCKETFILL) + 1, MAXBUCKETS);
+  }
+  else bk.n = (int) MIN(n / MINSAMPLE, MAXBUCKETS);
+  bk.n = (int) MIN((size_t) bk.n, mem / 2 / MERGEBUFMIN);
+  if (maxfd > 0) bk.n = (int) MIN(bk.n, maxfd - FDRESERVE);
+  bk.n = MAX(bk.n, 2);
+
+  /* sample the first chunk and the rest of the input (in proportion
+     to their size), sort the sample, and take splitters at even
+     intervals from it */
+  m = bk.n * OVERSAMPLE;
+  if (!(v = calloc(m, sizeof(*v))) || !(idx = malloc(m * sizeof(*idx))))
+    nomem();
+  int mchunk = rest > 0 ? (int) (m * ((double) bytes / (bytes + rest))) : m;
+  mchunk = (int) MIN(MAX(mchunk, 1), n);
+  for (i = 0; i < mchunk; i++) {
+    const char *s = plines->linebuf + plines->linepos[(2*i+1) * n / (2*mchunk)];
+    addsample(v, &ns, s, strlen(s));
+  }
+  samplefile(fin, v, &ns, m - mchunk);
+  for (i = 0; i < ns; i++) idx[i] = i;
+  quicksort(idx, ns, samplecmp, v);
+  if (!(bk.split = malloc((bk.n - 1) * sizeof(*bk.split))) ||
+      !(bk.fps = calloc(bk.n, sizeof(*bk.fps))) ||
+      !(bk.bytes = calloc(bk.n, sizeof(*bk.bytes))) ||
+      !(bk.nlines = calloc(bk.n, sizeof(*bk.nlines))) ||
+      !(bk.lag = calloc(bk.n, sizeof(*bk.lag))) ||
+      !(bk.mark = calloc(bk.n, sizeof(*bk.mark))))
+    nomem();
+  for (i = 0; i < bk.n - 1; i++)
+    bk.split[i] = v[idx[(i+1) * ns / bk.n]];
+
+  /* scatter: the first chunk, then the rest of the input in chunks
+     of the size of the run pipeline; half the memory for buffers */
+  bufsize = mergebufsize(bk.n, mem / 2);
+  for (i = 0; i < bk.n; i++) {
+    namebucket(buf, sizeof buf, i);
+    if (!(bk.fps[i] = fopen(buf, "w"))) {
+      error("cannot create file %s", buf);
+      r = FAILSOFT;
+      goto done;
+    }
+    setvbuf(bk.fps[i], 0, _IOFBF, bufsize);
+  }
+  t0 = now();
+  scatter(plines, &bk);
+  addtime(&stats.spilltime, t0);
+  if (bigchunk) {
+    freelines(plines);
+    setlimit(plines, budget / NCHUNKS);
+  }
+  do {
+    t0 = now();
+    clearlines(plines);
+    i = readlines(plines, fin);
+    if (ferror(fin)) {
+      error("error reading input");
+      r = FAILSOFT;
+      goto done;
+    }
+    addtime(&stats.readtime, t0);
+    t0 = now();
+    scatter(plines, &bk);
+    addtime(&stats.spilltime, t0);
+  } while (i > 0);
+  for (i = 0; i < bk.n; i++) {
+    if (ferror(bk.fps[i]) && r == SUCCESS) {
+      error("error writing temp file");
+      r = FAILSOFT;
+    }
+    if (nocache && bk.bytes[i] > 0)
+      dropwritten(bk.fps[i], &bk.lag[i], &bk.mark[i], bk.bytes[i], true);
+    fclose(bk.fps[i]);
+    bk.fps[i] = 0;
+    stats.spilled += bk.bytes[i];
+  }
+  if (r != SUCCESS) goto done;
+
+  /* sort the buckets in order: in memory if they fit (the chunk
+     limit is lifted for reading them), else by merging runs */
+  for (i = 0; i < bk.n && r == SUCCESS; i++) {
+    if (bk.nlines[i] == 0) continue;
+    namebucket(buf, sizeof buf, i);
+    if (!(fp = fopen(buf, "r"))) {
+      error("cannot open file %s", buf);
+      r = FAILSOFT;
+      break;
+    }
+    if (nocache) { /* read it ahead; it is deleted after reading */
+      posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise(fileno(fp), 0, bk.bytes[i], POSIX_FADV_WILLNEED);
+      stats.readahead += bk.bytes[i];
+    }
+    clearlines(plines);
+    used = bk.bytes[i] + bk.nlines[i] * (1 + overhead);
+    t0 = now();
+    if (used <= limit) {
+      plines->chunksize = 0;
+      readlines(plines, fp);
+    }
+    else {
+      bigs += 1;
+      if (bigchunk) setlimit(plines, budget / NCHUNKS);
+      else plines->chunksize = limit;
+      readlines(plines, fp);
+    }
+    if (ferror(fp)) {
+      error("error reading temp file");
+      r = FAILSOFT;
+    }
+    addtime(&stats.readtime, t0);
+    stats.reread += bk.bytes[i];
+    if (r == SUCCESS && used <= limit) {
+      size_t linebuf, linepos;
+      sizelines(plines, &linebuf, &linepos);
+      notemem(linebuf, linepos);
+      r = sortout(plines, fout);
+    }
+    else if (r == SUCCESS) {
+      r = runsort(plines, fp, fout, false);
+      freelines(plines);
+    }
+    fclose(fp);
+    remove(buf);
+  }
+
+  if (verbosity > 0)
+    fprintf(stderr, "(distribution sort used %d buckets, %d sampled lines, "
+      "%d buckets too large for memory)\n", bk.n, ns, bigs);
+
+done:
+  for (i = 0; i < bk.n; i++)
+    if (bk.fps[i]) fclose(bk.fps[i]);
+  for (i = 0; i < ns; i++) {
+    free(v[i].line);
+    free(v[i].key);
+  }
+  free(v);
+  free(idx);
+  free(bk.split);
+  free(bk.fps);
+  free(bk.bytes);
+  free(bk.nlines);
+  free(bk.lag);
+  free(bk.mark);
+  free(bk.key);
+  return r;
+}
+
+/* Temp file housekeeping: runs go to a private directory created
+   in each of the -T directories (or in $TMPDIR, or /tmp), so that
+   concurrent sorts do not collide; run 'num' is in spill directory
+   num % nspilldirs, so consecutive runs are spread over the disks */
+
+static char *spilldirs[MAXTEMPDIRS];
+static int nspilldirs = 0;
+
+/* create the spill directories; -1 on error (reported) */
+static int makespill(void)
+{
+  const char *tmp = getenv("TMPDIR");
+  char buf[PATHBUFLEN];
+  int i, try, n = ntempdirs;
+
+  if (n == 0) {
+    tempdirs[n++] = tmp && *tmp ? tmp : "/tmp";
+  }
+  atexit(dropspill); /* also after fatal() */
+  for (i = 0; i < n; i++) {
+    /* leave room for the names from nametemp() */
+    if (strlen(tempdirs[i]) + 32 > sizeof buf) {
+      error("directory name too long: %s", tempdirs[i]);
+      return -1;
+    }
+    for (try = 0; ; try++) { /* mkdir fails if the name is taken */
+      snprintf(buf, sizeof buf, "%s/sort%ld.%d", tempdirs[i],
+        (long) getpid(), try);
+      if (mkdir(buf, 0700) == 0) break;
+      if (errno != EEXIST || try == 100) {
+        error("cannot create directory %s", buf);
+        return -1;
+      }
+    }
+    if (!(spilldirs[nspilldirs] = malloc(strlen(buf) + 1))) {
+      rmdir(buf);
+      nomem();
+    }
+    strcpy(spilldirs[nspilldirs++], buf);
+  }
+  return 0;
+}
+
+/* delete the spill directories with any runs left in them */
+static void dropspill(void)
+{
+  char buf[PATHBUFLEN];
+  struct dirent *dp;
+  DIR *dir;
+  int i;
+
+  for (i = 0; i < nspilldirs; i++) {
+    if ((dir = opendir(spilldirs[i]))) {
+      while ((dp = readdir(dir)))
+        if (!streq(dp->d_name, ".") && !streq(dp->d_name, "..")) {
+          int len = snprintf(buf, sizeof buf, "%s/%s", spilldirs[i], dp->d_name);
+          if (len < (int) sizeof buf) remove(buf);
+        }
+      closedir(dir);
+    }
+    if (rmdir(spilldirs[i]) < 0)
+      error("cannot delete directory %s", spilldirs[i]);
+    free(spilldirs[i]);
+  }
+  nspilldirs = 0;
+}
+
+/* generate name of temp file 'num' in given buffer */
+static void nametemp(char *buf, size_t len, int num)
+{
+  const char *dir = spilldirs[num % nspilldirs];
+  size_t n = snprintf(buf, len, "%s/run%04d", dir, num);
+  assert(n < len); /* too long for given buffer */
+}
+
+/* generate name of bucket file 'num' (-D) in given buffer */
+static void namebucket(char *buf, size_t len, int num)
+{
+  const char *dir = spilldirs[num % nspilldirs];
+  size_t n = snprintf(buf, len, "%s/bucket%04d", dir, num);
+  assert(n < len); /* too long for given buffer */
+}
+
+/* assume temp file 'num' does not exist and create it */
+static FILE *maketemp(int num)
+{
+  char buf[PATHBUFLEN];
+  nametemp(buf, sizeof buf, num);
+  FILE *fp = fopen(buf, "w");
+  if (!fp) error("cannot create file %s", buf);
+  return fp;
+}
+
+/* assume temp file 'num' exists and open it for reading */
+static FILE *opentemp(int num)
+{
+  char buf[PATHBUFLEN];
+  nametemp(buf, sizeof buf, num);
+  FILE *fp = fopen(buf, "r");
+  if (!fp) error("cannot open file %s", buf);
+  return fp;
+}
+
+/* assume temp file 'num' exists and delete it */
+static void droptemp(int num)
+{
+  char buf[PATHBUFLEN];
+  nametemp(buf, sizeof buf, num);
+  int r = remove(buf);
+  if (r < 0) error("error deleting file %s", buf);
+}
+
+/* assume temp files lo..hi exist and open them for reading */
+static void opentemps(FILE **fps, int lo, int hi)
+{
+  int num;
+  for (num = lo; num <= hi; num++) {
+    fps[num-lo] = opentemp(num);
+  }
+}
+
+/* close and delete temp flies lo..hi */
+static void droptemps(FILE **fps, int lo, int hi)
+{
+  int num;
+  for (num = lo; num <= hi; num++) {
+    if (fps[num-lo]) fclose(fps[num-lo]);
+    droptemp(num);
+  }
+}
+
+/* Output file (-o): the output goes to a new file next to it, which
+   replaces it (by rename) only when complete, so the output file can
+   also be an input; it is preallocated for the size of the input,
+   which avoids fragmenting it, and written in large blocks.  This is
+   for a regular file with one link (or none yet): a symlink is
+   followed, and a FIFO, a device, or a file with other links is
+   written in place, opened (and truncated) by startout() only when
+   the input has been read */
+
+static char *outfile = 0; /* outpath, symlinks resolved */
+static char *outtemp = 0; /* the new file, until renamed */
+static char *outbuf = 0;  /* its stdio buffer */
+static bool outlater = false; /* write in place, not opened yet */
+
+/* return stdout, or a new file for -o (0 on error, reported) */
+static FILE *makeout(off_t size)
+{
+  char real[PATH_MAX];
+  const char *path = outpath;
+  struct stat st;
+  int fd, try;
+  FILE *fp;
+
+  if (!outpath || streq(outpath, "-")) return stdout;
+  if (realpath(outpath, real)) path = real;
+  if (!(outfile = malloc(strlen(path) + 32))) nomem();
+  strcpy(outfile, path);
+  atexit(dropout); /* also after fatal() */
+
+  if (stat(outfile, &st) == 0 && (!S_ISREG(st.st_mode) || st.st_nlink > 1)) {
+    if ((fd = open("/dev/null", O_WRONLY)) < 0) { /* until startout() */
+      error("cannot open file /dev/null");
+      return 0;
+    }
+    outlater = true;
+  }
+  else {
+    if (!(outtemp = malloc(strlen(outfile) + 32))) nomem();
+    for (try = 0; ; try++) { /* O_EXCL: fails if the name is taken */
+      sprintf(outtemp, "%s.sort%ld.%d", outfile, (long) getpid(), try);
+      if ((fd = open(outtemp, O_WRONLY|O_CREAT|O_EXCL, 0666)) >= 0) break;
+      if (errno != EEXIST || try == 100) {
+        error("cannot create file %s", outtemp);
+        free(outtemp);
+        outtemp = 0;
+        return 0;
+      }
+    }
+    if (stat(outfile, &st) == 0) /* keep the mode of the file replaced */
+      fchmod(fd, st.st_mode & 07777);
+    if (size > 0) /* a hint only: ignore failure */
+      posix_fallocate(fd, 0, size);
+  }
+  if (!(fp = fdopen(fd, "w"))) {
+    error("cannot open file %s", outtemp ? outtemp : outfile);
+    close(fd);
+    return 0;
+  }
+  if (posix_memalign((void **) &outbuf, 4096, OUTBUFSIZE) == 0)
+    setvbuf(fp, outbuf, _IOFBF, OUTBUFSIZE);
+  else outbuf = 0; /* use the default buffer */
+  return fp;
+}
+
+/* before the first output: if -o writes in place, open the file for
+   fp now, truncating it; -1 on error (reported) */
+static int startout(FILE *fp)
+{
+  int fd;
+
+  if (!outlater) return 0;
+  outlater = false;
+  if ((fd = open(outfile, O_WRONLY|O_TRUNC)) < 0) {
+    error("cannot open file %s", outfile);
+    return -1;
+  }
+  if (fflush(fp) != 0 || dup2(fd, fileno(fp)) < 0) {
+    error("cannot open file %s", outfile);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/* finish the output of a sort that returned r: for -o, drop the
+   rest of the preallocated space and rename the new file into
+   place if all went well, else delete it; return r or FAILSOFT */
+static int closeout(FILE *fp, int r)
+{
+  const char *name = outtemp ? outtemp : outfile;
+
+  if (fp == stdout) return r;
+  if (r == SUCCESS && outlater && startout(fp) < 0) /* no output */
+    r = FAILSOFT;
+  if (r == SUCCESS && outtemp) {
+    off_t len;
+    if (fflush(fp) != 0 || (len = ftello(fp)) < 0 ||
+        ftruncate(fileno(fp), len) < 0) {
+      error("error writing %s", name);
+      r = FAILSOFT;
+    }
+  }
+  if (fclose(fp) != 0 && r == SUCCESS) {
+    error("error writing %s", name);
+    r = FAILSOFT;
+  }
+  if (outtemp) {
+    if (r == SUCCESS && rename(outtemp, outfile) < 0) {
+      error("cannot rename %s to %s", outtemp, outfile);
+      r = FAILSOFT;
+    }
+    if (r != SUCCESS) remove(outtemp);
+  }
+  free(outfile);
+  free(outtemp);
+  free(outbuf);
+  outfile = outtemp = outbuf = 0;
+  outlater = false;
+  return r;
+}
+
+/* delete the new output file, if still there (after fatal()) */
+static void dropout(void)
+{
+  if (outtemp) remove(outtemp);
+}
+
+/* the bytes left in fp if it is a regular file, else 0 */
+static off_t insize(FILE *fp)
+{
+  struct stat st;
+  off_t pos = ftello(fp);
+  if (pos < 0 || fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode))
+    return 0;
+  return st.st_size > pos ? st.st_size - pos : 0;
+}
+
+/* Run files: a run is a sequence of blocks, each a header with its
+   unpacked and packed sizes, followed by the packed data (with -z,
+   and if packing made it smaller) or the data itself; a block holds
+   whole records, each the length of a line (with its newline and
+   NUL) as a varint, followed by the line, so reading a run takes
+   one read per block and never scans for newlines, and the merge
+   compares lines right in the block; text runs (plain lines) are
+   only read with -M and only written as the output; merges may run
+   in threads, so nothing here calls nomem(): errors are returned as
+   RUNERR (reported) or RUNNOMEM */
+
+struct run {
+  FILE *fp;
+  bool text;       /* plain lines, not records */
+  char *lp;        /* current line, 0 if run exhausted */
+  uint64_t prefix; /* keyprefix() of current line (or key) */
+  char *buf;       /* unpacked block, or current line if text */
+  size_t pos;      /* offset of next record in buf */
+  size_t len;      /* bytes in buf */
+  size_t size;     /* allocated size of buf */
+  char *zbuf;      /* packed block (-z) */
+  size_t zsize;    /* allocated size of zbuf */
+  char *key;       /* key of current line, if decorate */
+  size_t keysize;
+  int err;         /* RUNERR or RUNNOMEM, else 0 */
+  off_t off;       /* bytes of blocks read */
+  off_t done;      /* -N: dropped from the page cache up to here */
+  off_t ahead;     /* -N: read ahead up to here */
+  off_t fsize;     /* -N: size of the file */
+  off_t step;      /* -N: drop and read ahead in such steps */
+};
+
+struct runout {
+  FILE *fp;
+  bool text;     /* write plain lines, not records */
+  char *buf;     /* unpacked block */
+  size_t len;    /* bytes in buf */
+  size_t size;   /* allocated size of buf */
+  char *zbuf;    /* packed block (-z) */
+  size_t zsize;  /* allocated size of zbuf */
+  off_t off;     /* bytes of blocks written */
+  off_t lag;     /* -N: see dropwritten() */
+  off_t mark;
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -N: temp files are written once and read once, so their pages
+   need not stay in the page cache, where they would evict the data
+   of other processes; files written or read at the same time share
+   CACHEMEM, so the steps are smaller if there are many (buckets,
+   merge inputs); a file being written is advised away in steps:
+   the first advice starts writeback of the last step, the next one,
+   a step later, drops those pages, which are clean by then; at the
+   end, the file is synced so that all its pages can go; a file
+   being read is read ahead explicitly, and dropped behind */
+
+static void /* advise fp up to off away, in the step that ends at off */
+dropwritten(FILE *fp, off_t *plag, off_t *pmark, off_t off, bool last)
+{
+  fflush(fp);
+  if (last) fdatasync(fileno(fp));
+  posix_fadvise(fileno(fp), *plag, off - *plag, POSIX_FADV_DONTNEED);
+  pthread_mutex_lock(&statlock);
+  stats.dropped += off - *pmark;
+  pthread_mutex_unlock(&statlock);
+  *plag = *pmark;
+  *pmark = off;
+}
+
+static void /* advise run rp away behind rp->off, and read ahead */
+dropread(struct run *rp, bool last)
+{
+  int fd = fileno(rp->fp);
+  size_t dropped = 0, ahead = 0;
+  struct stat st;
+
+  if (rp->ahead == 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    rp->fsize = fstat(fd, &st) == 0 ? st.st_size : 0;
+  }
+  if (rp->off - rp->done >= rp->step || (last && rp->off > rp->done)) {
+    posix_fadvise(fd, rp->done, rp->off - rp->done, POSIX_FADV_DONTNEED);
+    dropped = rp->off - rp->done;
+    rp->done = rp->off;
+  }
+  if (!last && rp->off + rp->step > rp->ahead) {
+    off_t end = MIN(rp->off + 2*rp->step, rp->fsize);
+    if (end > rp->ahead) {
+      posix_fadvise(fd, rp->ahead, end - rp->ahead, POSIX_FADV_WILLNEED);
+      ahead = end - rp->ahead;
+    }
+    rp->ahead = rp->off + 2*rp->step;
+  }
+  if (dropped || ahead) {
+    pthread_mutex_lock(&statlock);
+    stats.dropped += dropped;
+    stats.readahead += ahead;
+    pthread_mutex_unlock(&statlock);
+  }
+}
+
+static int /* make room for n bytes in *pbuf; -1 if out of memory */
+reserve(char **pbuf, size_t *psize, size_t n)
+{
+  if (n <= *psize) return 0;
+  n = MAX(n, 2 * *psize);
+  char *p = realloc(*pbuf, n);
+  if (!p) return -1;
+  *pbuf = p;
+  *psize = n;
+  return 0;
+}
+
+static void /* write the text lines in rp->buf: the output is timed here */
+puttext(struct runout *rp)
+{
+  double t0 = now();
+  fwrite(rp->buf, 1, rp->len, rp->fp);
+  addtime(&stats.writetime, t0);
+  rp->len = 0;
+}
+
+static int /* (pack and) write the block in rp->buf; -1 if out of memory */
+putblock(struct runout *rp)
+{
+  uint32_t hdr[2]; /* unpacked and packed size */
+  double t0, t1, t2;
+  const char *data;
+
+  if (compress && reserve(&rp->zbuf, &rp->zsize, LZ_BOUND(rp->len)) < 0)
+    return -1;
+  t0 = now();
+  hdr[0] = rp->len;
+  hdr[1] = compress ? lzpack(rp->buf, rp->len, rp->zbuf) : rp->len;
+  if (hdr[1] >= hdr[0]) /* store as is */
+    hdr[1] = hdr[0], data = rp->buf;
+  else data = rp->zbuf;
+  t1 = now();
+  fwrite(hdr, sizeof(hdr), 1, rp->fp);
+  fwrite(data, 1, hdr[1], rp->fp);
+  t2 = now();
+
+  pthread_mutex_lock(&statlock);
+  stats.unpacked += hdr[0];
+  stats.packed += hdr[1];
+  stats.spilled += sizeof(hdr) + hdr[1];
+  stats.packtime += t1-t0;
+  stats.iotime += t2-t1;
+  pthread_mutex_unlock(&statlock);
+
+  rp->off += sizeof(hdr) + hdr[1];
+  if (nocache && rp->off - rp->mark >= CACHESTEP(1))
+    dropwritten(rp->fp, &rp->lag, &rp->mark, rp->off, false);
+
+  rp->len = 0;
+  return 0;
+}
+
+static size_t /* store n as a varint at p (7 bits per byte, low first) */
+putvarint(unsigned char *p, size_t n)
+{
+  size_t i = 0;
+  for (; n >= 0x80; n >>= 7)
+    p[i++] = (n & 0x7f) | 0x80;
+  p[i++] = n;
+  return i;
+}
+
+static size_t /* read a varint of at most len bytes at p; 0 if bad */
+getvarint(const unsigned char *p, size_t len, size_t *pn)
+{
+  size_t i, n = 0;
+  for (i = 0; i < len && i < MAXVARINT; i++) {
+    n |= (size_t) (p[i] & 0x7f) << 7*i;
+    if (!(p[i] & 0x80)) {
+      *pn = n;
+      return i+1;
+    }
+  }
+  return 0;
+}
+
+static int /* append line s to the run; -1 if out of memory */
+putline(struct runout *rp, const char *s)
+{
+  unsigned char hdr[MAXVARINT];
+  size_t n, m;
+
+  if (rp->text) {
+    n = strlen(s);
+    if (rp->len + n > rp->size) {
+      if (rp->len > 0) puttext(rp);
+      if (reserve(&rp->buf, &rp->size, MAX(n, BLOCKSIZE)) < 0) return -1;
+    }
+    memcpy(rp->buf + rp->len, s, n);
+    rp->len += n;
+    return 0;
+  }
+  n = strlen(s) + 1;
+  m = putvarint(hdr, n);
+  if (rp->len + m + n > rp->size) {
+    if (rp->len > 0 && putblock(rp) < 0) return -1;
+    if (reserve(&rp->buf, &rp->size, MAX(m + n, BLOCKSIZE)) < 0) return -1;
+  }
+  memcpy(rp->buf + rp->len, hdr, m);
+  memcpy(rp->buf + rp->len + m, s, n);
+  rp->len += m + n;
+  return 0;
+}
+
+static int /* write the last block and free buffers; -1 if out of memory */
+endrun(struct runout *rp)
+{
+  int r = 0;
+  if (rp->len > 0) {
+    if (rp->text) puttext(rp);
+    else r = putblock(rp);
+  }
+  if (nocache && !rp->text && rp->off > 0)
+    dropwritten(rp->fp, &rp->lag, &rp->mark, rp->off, true);
+  free(rp->buf);
+  free(rp->zbuf);
+  return r;
+}
+
+static int /* write lines as a run to fp; -1 if out of memory */
+writerun(struct lines *plines, FILE *fp)
+{
+  struct runout out = { fp, false, 0, 0, 0, 0, 0, 0, 0, 0 };
+  size_t i, n = countlines(plines);
+  int r = 0;
+
+  for (i = 0; i < n && r == 0; i++)
+    r = putline(&out, plines->linebuf + plines->linepos[i]);
+  return endrun(&out) < 0 ? -1 : r;
+}
+
+static int /* report a bad temp file (unless it was a read error) */
+corrupt(struct run *rp)
+{
+  if (!ferror(rp->fp)) error("corrupt temp file");
+  rp->err = RUNERR;
+  return -1;
+}
+
+static int /* read and unpack the next block; 0 at end, -1 on error */
+getblock(struct run *rp)
+{
+  uint32_t hdr[2]; /* unpacked and packed size */
+  double t0, t1, t2;
+  bool stored;
+
+  t0 = now();
+  if (fread(hdr, sizeof(hdr), 1, rp->fp) != 1) {
+    if (nocache) dropread(rp, true);
+    return 0;
+  }
+  stored = hdr[1] == hdr[0];
+  if (reserve(&rp->buf, &rp->size, hdr[0]) < 0 ||
+      (!stored && reserve(&rp->zbuf, &rp->zsize, hdr[1]) < 0)) {
+    rp->err = RUNNOMEM;
+    return -1;
+  }
+  if (fread(stored ? rp->buf : rp->zbuf, 1, hdr[1], rp->fp) != hdr[1])
+    return corrupt(rp);
+  t1 = now();
+  if (!stored && lzunpack(rp->zbuf, hdr[1], rp->buf, hdr[0]) != hdr[0])
+    return corrupt(rp);
+  if (hdr[0] == 0)
+    return corrupt(rp);
+  t2 = now();
+
+  pthread_mutex_lock(&statlock);
+  stats.reread += sizeof(hdr) + hdr[1];
+  stats.iotime += t1-t0;
+  stats.unpacktime += t2-t1;
+  pthread_mutex_unlock(&statlock);
+
+  rp->off += sizeof(hdr) + hdr[1];
+  if (nocache) dropread(rp, false);
+
+  rp->pos = 0;
+  rp->len = hdr[0];
+  return 1;
+}
+
+static int /* next record, from the next block if need be; 0 at end, -1 on error */
+getrecord(struct run *rp)
+{
+  size_t n, m;
+  int r;
+
+  if (rp->pos >= rp->len && (r = getblock(rp)) <= 0) return r;
+  m = getvarint((unsigned char *) rp->buf + rp->pos, rp->len - rp->pos, &n);
+  if (m == 0 || n == 0 || n > rp->len - rp->pos - m ||
+      rp->buf[rp->pos + m + n-1] != '\0')
+    return corrupt(rp);
+  rp->lp = rp->buf + rp->pos + m;
+  rp->pos += m + n;
+  return 1;
+}
+
+static int /* read a text line into rp->buf; 0 at end, -1 on error */
+getline1(struct run *rp)
+{
+  size_t n = 0;
+
+  for (;;) {
+    if (reserve(&rp->buf, &rp->size, n + BUFSIZ) < 0) {
+      rp->err = RUNNOMEM;
+      return -1;
+    }
+    if (!fgets(rp->buf + n, rp->size - n, rp->fp)) break;
+    n += strlen(rp->buf + n);
+    if (rp->buf[n-1] == '\n') break;
+  }
+  if (n == 0) return 0;
+  if (rp->buf[n-1] != '\n') /* fix incomplete last line */
+    strcpy(rp->buf + n, "\n");
+  rp->lp = rp->buf;
+  return 1;
+}
+
+static const char * /* advance to the next line of the run, 0 at end */
+nextline(struct run *rp)
+{
+  int r;
+
+  r = rp->text ? getline1(rp) : getrecord(rp);
+
+  if (r <= 0)
+    rp->lp = 0;
+  else if (decorate && setkey(&rp->key, &rp->keysize, rp->lp) < 0) {
+    rp->err = RUNNOMEM;
+    rp->lp = 0;
+  }
+  else rp->prefix = keyprefix(decorate ? rp->key : rp->lp);
+  return rp->lp;
+}
+
+static void
+closerun(struct run *rp)
+{
+  free(rp->buf);
+  free(rp->zbuf);
+  free(rp->key);
+}
+
+static int /* copy the lines of run fp to fout as text; -1 on error */
+copyrun(FILE *fp, FILE *fout)
+{
+  struct run run;
+  const char *s;
+
+  memset(&run, 0, sizeof(run));
+  run.fp = fp;
+  run.step = CACHESTEP(1);
+  while ((s = nextline(&run)))
+    fputs(s, fout);
+  closerun(&run);
+  if (run.err == RUNNOMEM) nomem();
+  return run.err ? -1 : 0;
+}
+
+static void
+packstats(void)
+{
+  size_t iobytes = stats.spilled + stats.reread;
+  double rate = iobytes ? stats.iotime / iobytes : 0;
+  double saved = 2 * (double) (stats.unpacked - stats.packed) * rate
+    - stats.packtime - stats.unpacktime;
+  fprintf(stderr, "(temp files packed %zu bytes to %zu = %.1f%%, "
+    "packing %.3fs, unpacking %.3fs, est. time saved %.3fs)\n",
+    stats.unpacked, stats.packed,
+    stats.unpacked ? 100.0 * stats.packed / stats.unpacked : 100.0,
+    stats.packtime, stats.unpacktime, saved);
+}
+
+static void
+addtime(double *pt, double t0)
+{
+  double t = now() - t0;
+  pthread_mutex_lock(&statlock);
+  *pt += t;
+  pthread_mutex_unlock(&statlock);
+}
+
+static void
+countcmp(void)
+{
+  struct counter *cp = pthread_getspecific(cmpkey);
+  if (!cp) {
+    if (!(cp = calloc(1, sizeof(*cp)))) return; /* not counted */
+    pthread_setspecific(cmpkey, cp);
+    pthread_mutex_lock(&statlock);
+    cp->next = stats.counters;
+    stats.counters = cp;
+    pthread_mutex_unlock(&statlock);
+  }
+  cp->n += 1;
+}
+
+static void /* record bytes allocated for lines, if a new peak */
+notemem(size_t linebuf, size_t linepos)
+{
+  pthread_mutex_lock(&statlock);
+  stats.linebuf = MAX(stats.linebuf, linebuf);
+  stats.linepos = MAX(stats.linepos, linepos);
+  pthread_mutex_unlock(&statlock);
+}
+
+/* report the statistics twice: for people, and as key=value pairs
+   on a line of its own for scripts */
+static void
+sortstats(void)
+{
+  struct counter *cp, *next;
+  size_t compares = 0;
+
+  for (cp = stats.counters; cp; cp = next) {
+    next = cp->next;
+    compares += cp->n;
+    free(cp);
+  }
+  stats.counters = 0;
+  if (counting) pthread_setspecific(cmpkey, 0);
+
+  fprintf(stderr, "(statistics: %zu comparisons, seconds reading %.3f, "
+    "sorting %.3f, spilling %.3f, merging %.3f, writing %.3f; "
+    "%zu bytes spilled, %zu re-read, %d merge passes; "
+    "peak memory linebuf %zu, linepos %zu bytes)\n",
+    compares, stats.readtime, stats.sorttime, stats.spilltime,
+    stats.mergetime, stats.writetime, stats.spilled, stats.reread,
+    stats.passes, stats.linebuf, stats.linepos);
+  if (nocache)
+    fprintf(stderr, "(page cache: %zu temp file bytes dropped, "
+      "%zu read ahead)\n", stats.dropped, stats.readahead);
+  fprintf(stderr, "sortstats compares=%zu readtime=%.6f sorttime=%.6f "
+    "spilltime=%.6f mergetime=%.6f writetime=%.6f spilled=%zu "
+    "reread=%zu passes=%d linebuf=%zu linepos=%zu dropped=%zu "
+    "readahead=%zu\n",
+    compares, stats.readtime, stats.sorttime, stats.spilltime,
+    stats.mergetime, stats.writetime, stats.spilled, stats.reread,
+    stats.passes, stats.linebuf, stats.linepos, stats.dropped,
+    stats.readahead);
+}
+
+/* Merging */
+
+/* exhausted runs compare greater than all others */
+static int mergecmp(int i, int j, void *userdata)
+{
+  struct run *runs = userdata;
+  const char *s = runs[i].lp;
+  const char *t = runs[j].lp;
+  COUNTCMP();
+  if (!s) return t ? 1 : 0;
+  if (!t) return -1;
+  if (runs[i].prefix != runs[j].prefix) { /* as in itemcmp() */
+    int r = runs[i].prefix < runs[j].prefix ? -1 : 1;
+    return reverse && !numeric ? -r : r;
+  }
+  if (decorate) return keyedcmp(runs[i].key, s, runs[j].key, t);
+  return compare(s, t);
+}
+
+/* merge runs infps[] to outfp, flags TEXTIN and TEXTOUT tell
+   which are text; return 0, RUNERR, or RUNNOMEM */
+static int merge(FILE *infps[], int numfp, FILE *outfp, int flags)
+{
+  struct run *runs = calloc(numfp, sizeof(*runs));
+  int *tree = malloc(numfp * sizeof(*tree)); /* loser tree */
+  struct runout out = { outfp, (flags & TEXTOUT) != 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  char *last = 0; /* -u: key (or line) last written */
+  size_t lastsize = 0;
+  int i, r = 0;
+
+  if (!runs || !tree) {
+    free(runs);
+    free(tree);
+    return RUNNOMEM;
+  }
+
+  for (i = 0; i < numfp; i++) {
+    runs[i].fp = infps[i];
+    runs[i].text = (flags & TEXTIN) != 0;
+    runs[i].step = CACHESTEP(numfp);
+    nextline(&runs[i]);
+  }
+
+  losertree(tree, numfp, mergecmp, runs);
+
+  while (runs[i = tree[0]].lp) {
+    const char *k = decorate ? runs[i].key : runs[i].lp;
+    if (!unique || !last || !samekey(last, k)) {
+      if (putline(&out, runs[i].lp) < 0) { r = RUNNOMEM; break; }
+      if (unique) {
+        if (reserve(&last, &lastsize, strlen(k) + 1) < 0) { r = RUNNOMEM; break; }
+        strcpy(last, k);
+      }
+    }
+    if (!nextline(&runs[i]) && runs[i].err) break;
+    loserupdate(tree, numfp, mergecmp, runs); /* at end: one less run */
+  }
+  if (endrun(&out) < 0) r = RUNNOMEM;
+
+  for (i = 0; i < numfp; i++) {
+    if (runs[i].err && r == 0) r = runs[i].err;
+    closerun(&runs[i]);
+  }
+  free(last);
+  free(runs);
+  free(tree);
+  return r;
+}
+
+/* Sorting algorithm */
+
+static void /* sort v[0..n-1] with the best method for the options */
+sortitems(struct item *v, size_t n, const char *linebuf)
+{
+  if (n >= 2*MINRUN && natural(v, n, linebuf))
+    return; /* was (nearly) sorted */
+  if (n >= RADIXMIN)
+    radix(v, n, linebuf);
+  else if (n > 1)
+    quick(v, 0, n-1, linebuf);
+}
+
+static void introsort(struct item *v, size_t lo, size_t hi, int depth,
+                      const char *linebuf);
+static void insertsort(struct item *v, size_t lo, size_t hi,
+                       const char *linebuf);
+static void heapsort2(struct item *v, size_t lo, size_t hi,
+                      const char *linebuf);
+static void siftdown(struct item *v, size_t i, size_t n, const char *linebuf);
+static void swap(struct item *v, size_t i, size_t j);
+static int itemcmp(const struct item *a, const struct item *b,
+                   const char *linebuf);
+
+/* Quicksort with three-way partitioning: lines equal to the pivot
+   are gathered in the middle and left alone (so many equal lines
+   are cheap); median-of-three pivots; insertion sort for ranges
+   of at most INSERTMAX lines; and heap sort if the recursion gets
+   deeper than 2 log n (bad pivots), so it is O(n log n) always */
+
+static void
+quick(struct item *v, size_t lo, size_t hi, const char *linebuf)
+{
+  size_t n;
+  int depth = 0;
+  if (lo >= hi) return; /* nothing to sort */
+  for (n = hi-lo+1; n > 1; n /= 2) depth += 2;
+  introsort(v, lo, hi+1, depth, linebuf);
+}
+
+static void /* sort v[lo..hi-1]; NB hi is exclusive */
+introsort(struct item *v, size_t lo, size_t hi, int depth, const char *linebuf)
+{
+  size_t i, lt, gt, mid;
+  struct item pivot;
+
+  while (hi-lo > INSERTMAX) {
+    if (depth-- <= 0) {
+      heapsort2(v, lo, hi, linebuf);
+      return;
+    }
+
+    /* median of three: order v[lo] <= v[mid] <= v[hi-1] */
+    mid = lo + (hi-lo)/2;
+    if (itemcmp(&v[mid], &v[lo], linebuf) < 0) swap(v, lo, mid);
+    if (itemcmp(&v[hi-1], &v[mid], linebuf) < 0) {
+      swap(v, mid, hi-1);
+      if (itemcmp(&v[mid], &v[lo], linebuf) < 0) swap(v, lo, mid);
+    }
+    pivot = v[mid];
+
+    /* invariant: v[lo..lt-1] < pivot, v[lt..i-1] == pivot,
+       v[gt..hi-1] > pivot, and v[i..gt-1] not yet looked at */
+    lt = i = lo; gt = hi;
+    while (i < gt) {
+      int c = itemcmp(&v[i], &pivot, linebuf);
+      if (c < 0) swap(v, lt++, i++);
+      else if (c > 0) swap(v, i, --gt);
+      else i++;
+    }
+
+    if (lt-lo < hi-gt) {   /* recurse smaller subset, loop on larger */
+      introsort(v, lo, lt, depth, linebuf);
+      lo = gt;
+    } else {
+      introsort(v, gt, hi, depth, linebuf);
+      hi = lt;
+    }
+  }
+
+  insertsort(v, lo, hi, linebuf);
+}
+
+static void /* sort v[lo..hi-1] by straight insertion */
+insertsort(struct item *v, size_t lo, size_t hi, const char *linebuf)
+{
+  size_t i, j;
+  for (i = lo+1; i < hi; i++) {
+    struct item t = v[i];
+    for (j = i; j > lo && itemcmp(&v[j-1], &t, linebuf) > 0; j--)
+      v[j] = v[j-1];
+    v[j] = t;
+  }
+}
+
+static void /* sort v[lo..hi-1] by heap sort */
+heapsort2(struct item *v, size_t lo, size_t hi, const char *linebuf)
+{
+  size_t i, n = hi-lo;
+  for (i = n/2; i > 0; i--)
+    siftdown(v+lo, i-1, n, linebuf);
+  while (n > 1) {
+    swap(v+lo, 0, --n); /* move max to the end */
+    siftdown(v+lo, 0, n, linebuf);
+  }
+}
+
+static void /* sift v[i] down the heap v[0..n-1] */
+siftdown(struct item *v, size_t i, size_t n, const char *linebuf)
+{
+  size_t j;
+  while ((j = 2*i+1) < n) {
+    if (j+1 < n && itemcmp(&v[j], &v[j+1], linebuf) < 0) j += 1;
+    if (itemcmp(&v[i], &v[j], linebuf) >= 0) break;
+    swap(v, i, j);
+    i = j;
+  }
+}
+
+static void
+swap(struct item *v, size_t i, size_t j)
+{
+  struct item t = v[i];
+  v[i] = v[j];
+  v[j] = t;
+}
+
+/* prefixes decide unless equal; then compare the lines proper
+   (or the keys, and if they are equal, the lines they belong to) */
+static int
+itemcmp(const struct item *a, const struct item *b, const char *linebuf)
+{
+  const char *s = linebuf + a->pos;
+  const char *t = linebuf + b->pos;
+  int r;
+
+  COUNTCMP();
+  if (a->prefix != b->prefix)
+    r = a->prefix < b->prefix ? -1 : 1;
+  else if (!decorate)
+    return compare(s, t);
+  else return keyedcmp(s, keyline(s), t, keyline(t));
+
+  return reverse && !numeric ? -r : r;
+}
+
+/* Radix sorting: for plain byte order (with or without -r),
+   an MSD radix sort (American flag sort) distributes the index
+   in place on one key byte at a time; while depth < 8 the byte
+   comes from the prefix, not from linebuf; the bytes for the
+   current bucket are cached in a side array so each line is
+   touched once per pass; small buckets are left to quick();
+   with -n, it sorts on the numeric keys in the prefixes only,
+   and buckets of equal keys are left to quick() as well */
+
+struct bucket {
+  size_t lo, hi;  /* v[lo..hi-1] */
+  size_t depth;   /* all lines in bucket agree in bytes 0..depth-1 */
+};
+
+static void
+radix(struct item *v, size_t n, const char *linebuf)
+{
+  const unsigned char *lb = (const void *) linebuf;
+  unsigned char *cache = malloc(n);
+  /* pending buckets are disjoint and have >= RADIXMIN lines */
+  struct bucket *stack = malloc((n/RADIXMIN+1) * sizeof(*stack));
+  size_t count[256], next[256], end[256];
+  size_t i, sp = 0;
+  int c, k;
+
+  if (!cache || !stack) { /* may run in a thread: don't bail out */
+    free(cache);
+    free(stack);
+    if (n > 1) quick(v, 0, n-1, linebuf);
+    return;
+  }
+
+  stack[sp].lo = 0;
+  stack[sp].hi = n;
+  stack[sp++].depth = 0;
+
+  while (sp > 0) {
+    struct bucket b = stack[--sp];
+
+    memset(count, 0, sizeof(count));
+    for (i = b.lo; i < b.hi; i++) {
+      if (b.depth < 8)
+        c = (v[i].prefix >> (56 - 8*b.depth)) & 0xff;
+      else c = lb[v[i].pos + b.depth];
+      cache[i] = c;
+      count[c]++;
+    }
+
+    /* bucket boundaries; reverse sort lays them out backwards */
+    for (i = b.lo, k = 0; k < 256; k++) {
+      c = reverse && !numeric ? 255-k : k;
+      next[c] = i;
+      i += count[c];
+      end[c] = i;
+    }
+
+    /* permute: move each item into its bucket, following cycles */
+    for (k = 0; k < 256; k++) {
+      while (next[k] < end[k]) {
+        struct item it = v[next[k]];
+        c = cache[next[k]];
+        while (c != k) {
+          size_t j = next[c]++;
+          struct item t = v[j];
+          int tc = cache[j];
+          v[j] = it; cache[j] = c;
+          it = t; c = tc;
+        }
+        v[next[k]] = it;
+        cache[next[k]++] = c;
+      }
+    }
+
+    /* bucket 0 holds lines that end here: they are all equal,
+       but equal keys are ordered by the lines they belong to */
+    if (!numeric && decorate && count[0] > 1)
+      quick(v, end[0]-count[0], end[0]-1, linebuf);
+    for (c = numeric ? 0 : 1; c < 256; c++) {
+      size_t lo = end[c] - count[c];
+      if (count[c] >= RADIXMIN && (!numeric || b.depth < 7)) {
+        stack[sp].lo = lo;
+        stack[sp].hi = end[c];
+        stack[sp++].depth = b.depth + 1;
+      }
+      else if (count[c] > 1)
+        quick(v, lo, end[c]-1, linebuf);
+    }
+  }
+
+  free(cache);
+  free(stack);
+}
+
+/* Natural merge sort: already sorted input, or input made of a few
+   sorted (or reverse sorted) pieces, is sorted by finding the runs,
+   reversing the descending ones, and merging adjacent runs pairwise:
+   n comparisons to find the runs and n log2(#runs) to merge them.
+   Equal lines are identical, so they join a run either way, and the
+   direction is set by the first unequal pair.  As in Timsort, runs
+   shorter than MINRUN are extended by insertion; the scan gives up
+   (leaving v[] permuted, but complete) as soon as the natural runs are
+   shorter than RUNAVG on average, which for random input is after a
+   few comparisons, or when more than SHORTMAX runs in a row are
+   shorter than 2*MINRUN, where merging is slower than the default */
+
+static void mergeitems(const struct item *a, size_t m, const struct item *b,
+                       size_t n, struct item *out, const char *linebuf);
+
+static bool /* sort v[0..n-1] if it has long runs, else return false */
+natural(struct item *v, size_t n, const char *linebuf)
+{
+  size_t *bounds, nruns = 0, natlen = 0, nshort = 0, i, j, lo, mid, hi;
+  struct item *w, *v0 = v, *t;
+  int c = 0;
+
+  bounds = malloc((n/MINRUN + 2) * sizeof(*bounds));
+  if (!bounds) return false;
+
+  for (i = 0; i < n; i = j) {
+    j = i+1;
+    while (j < n && (c = itemcmp(&v[j-1], &v[j], linebuf)) == 0) j++;
+    if (j < n && c > 0) {
+      while (++j < n && itemcmp(&v[j-1], &v[j], linebuf) >= 0) ;
+      for (lo = i, hi = j; lo+1 < hi; lo++, hi--) /* descending: reverse */
+        swap(v, lo, hi-1);
+    }
+    else while (j < n && itemcmp(&v[j-1], &v[j], linebuf) <= 0) j++;
+    natlen += j-i;
+    bounds[nruns++] = i;
+    nshort = (j-i < 2*MINRUN && j < n) ? nshort+1 : 0;
+    if (nruns > 1 + natlen/RUNAVG || nshort > SHORTMAX) {
+      free(bounds);
+      return false;
+    }
+    if (j-i < MINRUN && j < n) {
+      j = MIN(i+MINRUN, n);
+      insertsort(v, i, j, linebuf);
+    }
+  }
+  bounds[nruns] = n;
+
+  if (nruns < 2 || !(w = malloc(n * sizeof(*w)))) {
+    free(bounds);
+    return nruns < 2;
+  }
+
+  while (nruns > 1) {
+    size_t npairs = nruns / 2;
+    for (i = 0; i < npairs; i++) {
+      lo = bounds[2*i], mid = bounds[2*i+1], hi = bounds[2*i+2];
+      mergeitems(v+lo, mid-lo, v+mid, hi-mid, w+lo, linebuf);
+    }
+    if (nruns % 2) { /* odd run out: copy as-is */
+      lo = bounds[nruns-1];
+      memcpy(w+lo, v+lo, (n-lo) * sizeof(*v));
+    }
+    for (i = 0; i < npairs; i++)
+      bounds[i+1] = bounds[2*i+2];
+    bounds[npairs + nruns%2] = n;
+    nruns = npairs + nruns%2;
+    t = v; v = w; w = t; /* merged runs are now in v */
+  }
+
+  if (v != v0) { /* result is in the scratch array */
+    memcpy(v0, v, n * sizeof(*v));
+    w = v;
+  }
+  free(w);
+  free(bounds);
+  return true;
+}
+
+static void /* merge a[0..m-1] and b[0..n-1] into out[0..m+n-1] */
+mergeitems(const struct item *a, size_t m, const struct item *b,
+           size_t n, struct item *out, const char *linebuf)
+{
+  size_t i = 0, j = 0;
+  if (m > 0 && n > 0 && itemcmp(&a[m-1], &b[0], linebuf) > 0)
+    while (i < m && j < n) { /* else already in order: just copy */
+      if (itemcmp(&a[i], &b[j], linebuf) <= 0)
+        *out++ = a[i++];
+      else *out++ = b[j++];
+    }
+  memcpy(out, a+i, (m-i) * sizeof(*a));
+  memcpy(out + (m-i), b+j, (n-j) * sizeof(*b));
+}
+
+/* Parallel sorting: split v[] into one piece per thread,
+   sort the pieces concurrently, then merge pairs of pieces
+   until one is left; every merge is itself split into slices
+   of the output (by binary search for the split points in the
+   two inputs), so all threads are kept busy until the end */
+
+struct task {
+  struct item *v, *w;   /* source and destination arrays */
+  size_t lo, mid, hi;   /* sort v[lo..hi-1], or merge v[lo..mid-1]
+                           and v[mid..hi-1] into w[lo..hi-1] */
+  size_t klo, khi;      /* slice of the merged output */
+  const char *linebuf;
+};
+
+static void runtasks(struct task *tasks, int n, void *(*fun)(void *));
+static void *sorttask(void *arg);
+static void *mergetask(void *arg);
+static size_t corank(size_t k, const struct item *a, size_t m,
+                     const struct item *b, size_t n, const char *linebuf);
+
+static void
+psort(struct item *v, size_t n, const char *linebuf, int nthreads)
+{
+  size_t bounds[1+nthreads]; /* piece i is v[bounds[i]..bounds[i+1]-1] */
+  struct task tasks[nthreads];
+  struct item *v0 = v, *w, *t;
+  int i, k, npieces = nthreads;
+
+  w = malloc(n * sizeof(*w));
+  if (!w) { /* may run in a thread: sort sequentially instead */
+    sortitems(v, n, linebuf);
+    return;
+  }
+
+  for (i = 0; i <= npieces; i++)
+    bounds[i] = n / npieces * i + MIN((size_t) i, n % npieces);
+
+  for (i = 0; i < npieces; i++) {
+    tasks[i].v = v;
+    tasks[i].lo = bounds[i];
+    tasks[i].hi = bounds[i+1];
+    tasks[i].linebuf = linebuf;
+  }
+  runtasks(tasks, npieces, sorttask);
+
+  while (npieces > 1) {
+    int npairs = npieces / 2;
+    int nslices = MAX(1, nthreads / npairs);
+    int ntasks = 0;
+    for (i = 0; i < npairs; i++) {
+      size_t lo = bounds[2*i], mid = bounds[2*i+1], hi = bounds[2*i+2];
+      for (k = 0; k < nslices; k++) {
+        struct task *tp = &tasks[ntasks++];
+        tp->v = v; tp->w = w;
+        tp->lo = lo; tp->mid = mid; tp->hi = hi;
+        tp->klo = (hi-lo) / nslices * k;
+        tp->khi = k+1 < nslices ? (hi-lo) / nslices * (k+1) : hi-lo;
+        tp->linebuf = linebuf;
+      }
+    }
+    runtasks(tasks, ntasks, mergetask);
+    if (npieces % 2) { /* odd piece out: copy as-is */
+      size_t lo = bounds[npieces-1], hi = bounds[npieces];
+      memcpy(w+lo, v+lo, (hi-lo) * sizeof(*v));
+    }
+    for (i = 0; i < npairs; i++)
+      bounds[i+1] = bounds[2*i+2];
+    if (npieces % 2)
+      bounds[npairs+1] = bounds[npieces];
+    npieces = npairs + npieces % 2;
+    t = v; v = w; w = t; /* merged pieces are now in v */
+  }
+
+  if (v != v0) { /* result is in the scratch array */
+    memcpy(v0, v, n * sizeof(*v));
+    w = v;
+  }
+  free(w);
+}
+
+static void
+runtasks(struct task *tasks, int n, void *(*fun)(void *))
+{
+  pthread_t threads[n];
+  bool started[n];
+  int i;
+
+  for (i = 1; i < n; i++)
+    started[i] = pthread_create(&threads[i], 0, fun, &tasks[i]) == 0;
+  fun(&tasks[0]); /* run first task in this thread */
+  for (i = 1; i < n; i++) {
+    if (started[i]) pthread_join(threads[i], 0);
+    else fun(&tasks[i]); /* no thread: do it ourselves */
+  }
+}
+
+static void *
+sorttask(void *arg)
+{
+  struct task *tp = arg;
+  sortitems(tp->v + tp->lo, tp->hi - tp->lo, tp->linebuf);
+  return 0;
+}
+
+static void *
+mergetask(void *arg)
+{
+  struct task *tp = arg;
+  const struct item *a = tp->v + tp->lo, *b = tp->v + tp->mid;
+  size_t m = tp->mid - tp->lo, n = tp->hi - tp->mid;
+  size_t i = corank(tp->klo, a, m, b, n, tp->linebuf);
+  size_t j = tp->klo - i;
+  size_t ilim = corank(tp->khi, a, m, b, n, tp->linebuf);
+  size_t jlim = tp->khi - ilim;
+  struct item *out = tp->w + tp->lo + tp->klo;
+
+  mergeitems(a+i, ilim-i, b+j, jlim-j, out, tp->linebuf);
+  return 0;
+}
+
+/* number of items from a[] among the first k of the merge of
+   a[0..m-1] and b[0..n-1] (on ties, items from a[] come first) */
+static size_t
+corank(size_t k, const struct item *a, size_t m,
+       const struct item *b, size_t n, const char *linebuf)
+{
+  size_t lo = k > n ? k-n : 0;
+  size_t hi = MIN(k, m);
+  while (lo < hi) {
+    size_t i = lo + (hi-lo)/2, j = k-i; /* i < m and j > 0 */
+    if (itemcmp(&a[i], &b[j-1], linebuf) <= 0)
+      lo = i+1;
+    else hi = i;
+  }
+  return lo;
+}
+
+/* Options and usage */
+
+static int
+parseopts(int argc, char **argv, size_t *chunksize)
+{
+  long l;
+  int i, showhelp = 0;
+
+  for (i = 1; i < argc && argv[i]; i++) {
+    const char *p = argv[i];
+    if (*p != '-' || streq(p, "-")) break; /* no more option args */
+    if (streq(p, "--")) { ++i; break; } /* end of option args */
+    for (++p; *p; p++) {
+      switch (*p) {
+        case 'd': dictsort = true; break;
+        case 'f': casefold = true; break;
         case 'n': numeric = true; break;
         case 'r': reverse = true; break;
+        case 'z': compress = true; break;
+        case 'M': mergeonly = true; break;
+        case 'D': distribute = true; break;
+        case 'N': nocache = true; break;
+        case 'C': checkonly = true; break;
+        case 'u': unique = true; break;
         case 'c':
           if (argv[i+1] && (l = atol(argv[i+1])) > 0 && !*(p+1)) {
             *chunksize = l;
@@ -391,6 +2997,76 @@ parseopts(int argc, char **argv, size_t *chunksize)
           }
           usage("option -c requires a positive number argument");
           return -1;
+        case 'm':
+          if (argv[i+1] && (l = atol(argv[i+1])) > 0 && !*(p+1)) {
+            topk = (int) MIN(l, INT_MAX-1);
+            i += 1;
+            break;
+          }
+          usage("option -m requires a positive number argument");
+          return -1;
+        case 'k':
+          if (argv[i+1] && parsekey(argv[i+1]) == 0 && !*(p+1)) {
+            i += 1;
+            break;
+          }
+          usage("option -k requires fields like 2 or 2,3");
+          return -1;
+        case 't':
+          if (argv[i+1] && argv[i+1][0] && !argv[i+1][1] &&
+              argv[i+1][0] != '\n' && !*(p+1)) {
+            fieldseps[0] = argv[i+1][0];
+            fieldseps[1] = '\n';
+            fieldseps[2] = 0;
+            blanksep = false;
+            i += 1;
+            break;
+          }
+          usage("option -t requires a single character");
+          return -1;
+        case 'S':
+          if (argv[i+1] && (budget = parsesize(argv[i+1])) > 0 && !*(p+1)) {
+            i += 1;
+            break;
+          }
+          usage("option -S requires a size like 800M or 25%");
+          return -1;
+        case 'o':
+          if (argv[i+1] && argv[i+1][0] && !*(p+1)) {
+            outpath = argv[i+1];
+            i += 1;
+            break;
+          }
+          usage("option -o requires a file argument");
+          return -1;
+        case 'T':
+          if (argv[i+1] && argv[i+1][0] && !*(p+1)) {
+            if (ntempdirs == MAXTEMPDIRS) {
+              usage("too many -T options");
+              return -1;
+            }
+            tempdirs[ntempdirs++] = argv[i+1];
+            i += 1;
+            break;
+          }
+          usage("option -T requires a directory argument");
+          return -1;
+        case 'j':
+          if (argv[i+1] && (l = atol(argv[i+1])) > 0 && !*(p+1)) {
+            jobs = (int) MIN(l, MAXJOBS);
+            i += 1;
+            break;
+          }
+          usage("option -j requires a positive number argument");
+          return -1;
+        case 'P':
+          if (argv[i+1] && (l = atol(argv[i+1])) > 0 && !*(p+1)) {
+            iojobs = (int) MIN(l, MAXJOBS);
+            i += 1;
+            break;
+          }
+          usage("option -P requires a positive number argument");
+          return -1;
         case 'h': showhelp = 1;
           break;
         default: usage("invalid option");
@@ -407,16 +3083,79 @@ parseopts(int argc, char **argv, size_t *chunksize)
   return i; /* #args parsed */
 }
 
+/* parse a key like 2 (field 2 to end of line) or 2,3 (fields 2
+   and 3); set keybeg and keyend; return -1 if invalid */
+static int
+parsekey(const char *s)
+{
+  char *end;
+  long beg = strtol(s, &end, 10), last = 0;
+
+  if (end == s || beg < 1 || beg > INT_MAX) return -1;
+  if (*end == ',') {
+    s = end+1;
+    last = strtol(s, &end, 10);
+    if (end == s || last < beg || last > INT_MAX) return -1;
+  }
+  if (*end) return -1;
+  keybeg = (int) beg;
+  keyend = (int) last;
+  return 0;
+}
+
+/* parse a size like 64K, 1.5G, or 25% (of physical memory);
+   return the number of bytes, or 0 if invalid */
+static size_t
+parsesize(const char *s)
+{
+  char *end;
+  double d = strtod(s, &end);
+  long pages, pagesize;
+
+  switch (*end) {
+    case 'k': case 'K': d *= 1024; end++; break;
+    case 'm': case 'M': d *= 1024 * 1024; end++; break;
+    case 'g': case 'G': d *= 1024 * 1024 * 1024; end++; break;
+    case '%':
+      pages = sysconf(_SC_PHYS_PAGES);
+      pagesize = sysconf(_SC_PAGESIZE);
+      if (pages <= 0 || pagesize <= 0 || d > 100) return 0;
+      d = d / 100 * pages * pagesize;
+      end++;
+      break;
+  }
+  if (end == s || *end || !(d >= 1) || d >= (double) SIZE_MAX)
+    return 0;
+  return (size_t) d;
+}
+
 static void
 usage(const char *errmsg)
 {
   FILE *fp = errmsg ? stderr : stdout;
   if (errmsg) fprintf(fp, "%s: %s\n", me, errmsg);
-  fprintf(fp, "Usage: %s [-d] [-f] [-n] [-r] [-c bytes]\n", me);
+  fprintf(fp, "Usage: %s [-d] [-f] [-n] [-r] [-u] [-z] [-c bytes] [-S size] [-j num]\n"
+    "       [-P num] [-T dir] [-m num] [-k field[,field]] [-t char] [-D] [-N] [-M]\n"
+    "       [-o outfile] [file ...]\n"
+    "       %s -C [options] [file]\n", me, me);
   fprintf(fp, "Sort text lines\n");
   fprintf(fp, "  -c bytes   chunk size (in-memory sort if not specified)\n");
+  fprintf(fp, "  -S size    memory budget, like 800M or 25%% (sort externally if exceeded)\n");
+  fprintf(fp, "  -j num     number of threads for sorting in memory\n");
+  fprintf(fp, "  -P num     number of merges to run at once (external sort)\n");
+  fprintf(fp, "  -T dir     put temporary files into dir (repeat to spread them)\n");
+  fprintf(fp, "  -m num     output only the first num lines of the sorted order\n");
+  fprintf(fp, "  -k m[,n]   sort on fields m to n (or to end of line)\n");
+  fprintf(fp, "  -t char    fields are separated by char (default: blanks)\n");
+  fprintf(fp, "  -o file    write the output to file (replaced when complete)\n");
   fprintf(fp, "  -d   dictionary sort: compare only on letters and digits\n");
   fprintf(fp, "  -f   fold lower case and upper case (i.e., ignore case)\n");
   fprintf(fp, "  -n   numeric sort: assume first token is a number\n");
   fprintf(fp, "  -r   reverse sort\n");
+  fprintf(fp, "  -u   unique: output only the first of lines that compare equal\n");
+  fprintf(fp, "  -D   external sort by distribution into buckets, not by merging\n");
+  fprintf(fp, "  -N   keep temporary files out of the page cache\n");
+  fprintf(fp, "  -M   merge the given files, which must be sorted already\n");
+  fprintf(fp, "  -C   check that the input is sorted, do not sort (status 1 if not)\n");
+  fprintf(fp, "  -z   compress temporary files (with -c or -S)\n");
 }
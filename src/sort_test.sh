@@ -0,0 +1,345 @@
+#!/bin/sh
+# Testing sort by comparing against expected output
+
+trap 'rm -rf "$TMPFILE" "$INFILE" "$TDIR1" "$TDIR2"' EXIT
+TMPFILE=$(mktemp) || exit 1
+INFILE=$(mktemp) || exit 1
+TDIR1=$(mktemp -d) || exit 1
+TDIR2=$(mktemp -d) || exit 1
+echo "Using temp files $TMPFILE $INFILE"
+
+echo "Testing sort"
+
+RED="\033[31m"
+RESET="\033[0m"
+status=0
+error() { printf "${RED}$* FAILED${RESET}\n"; status=1; }
+
+### Numbers (-n): sign, -0, fractions, more than 17 digits,
+### more than 64 bits; lines without a number come last
+cat << EOT > $INFILE
++2
+-0
+0
+.5
+0.50
+-.5
+-1.5
+-1.25
+10
+9.99
+x
+
+123456789012345678901
+123456789012345678902
+99999999999999999999999
+-99999999999999999999999
+1e3
+007
+7
+EOT
+cat << EOT > $TMPFILE
+-99999999999999999999999
+-1.5
+-1.25
+-.5
+-0
+0
+.5
+0.50
+1e3
++2
+007
+7
+9.99
+10
+123456789012345678901
+123456789012345678902
+99999999999999999999999
+
+x
+EOT
+bin/quux sort -n $INFILE | cmp $TMPFILE || error "Test -n 1"
+
+# with -r, lines without a number still come last
+cat << EOT > $TMPFILE
+99999999999999999999999
+123456789012345678902
+123456789012345678901
+10
+9.99
+7
+007
++2
+1e3
+0.50
+.5
+0
+-0
+-.5
+-1.25
+-1.5
+-99999999999999999999999
+x
+
+EOT
+bin/quux sort -n -r $INFILE | cmp $TMPFILE || error "Test -n 2"
+
+# equal numbers are duplicates: the first in byte order is kept
+cat << EOT > $TMPFILE
+-99999999999999999999999
+-1.5
+-1.25
+-.5
+-0
+.5
+1e3
++2
+007
+9.99
+10
+123456789012345678901
+123456789012345678902
+99999999999999999999999
+
+x
+EOT
+bin/quux sort -n -u $INFILE | cmp $TMPFILE || error "Test -n 3"
+
+### Fields (-k, -t): too few fields make an empty key
+cat << EOT > $INFILE
+b,3,x
+a,10,y
+c,2
+d
+,1,z
+EOT
+cat << EOT > $TMPFILE
+,1,z
+c,2
+b,3,x
+a,10,y
+d
+EOT
+bin/quux sort -n -t , -k 2,2 $INFILE | cmp $TMPFILE || error "Test -k 1"
+cat << EOT > $TMPFILE
+c,2
+d
+b,3,x
+a,10,y
+,1,z
+EOT
+bin/quux sort -t , -k 3 $INFILE | cmp $TMPFILE || error "Test -k 2"
+
+# blanks separate fields in runs, but -t ' ' separates at each space
+printf 'x  b\nx a\nx\tc\n' > $INFILE
+printf 'x a\nx  b\nx\tc\n' > $TMPFILE
+bin/quux sort -k 2,2 $INFILE | cmp $TMPFILE || error "Test -k 3"
+printf 'x\tc\nx  b\nx a\n' > $TMPFILE
+bin/quux sort -t ' ' -k 2,2 $INFILE | cmp $TMPFILE || error "Test -k 4"
+
+### Parallel sort (-j): at least 4096 lines per thread
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%05d\n", i * 7919 % 20000 }' > $INFILE
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%05d\n", i }' > $TMPFILE
+bin/quux sort -j 4 $INFILE | cmp $TMPFILE || error "Test -j 1"
+awk 'BEGIN { for (i = 19999; i >= 0; i--) printf "%05d\n", i }' > $TMPFILE
+bin/quux sort -r -j 3 $INFILE | cmp $TMPFILE || error "Test -j 2"
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%d\n", i * 7919 % 20000 }' > $INFILE
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%d\n", i }' > $TMPFILE
+bin/quux sort -n -j 2 $INFILE | cmp $TMPFILE || error "Test -j 3"
+
+### Natural runs: ascending, descending, and ascending again,
+### with duplicates; the comparisons show whether the runs were used
+awk 'BEGIN { for (i = 0; i < 64; i++) printf "%03d\n", int(i/2)
+  for (i = 63; i >= 0; i--) printf "%03d\n", int(i/2)
+  for (i = 0; i < 64; i++) printf "%03d\n", int(i/2) }' > $INFILE
+awk 'BEGIN { for (i = 0; i < 192; i++) printf "%03d\n", int(i/6) }' > $TMPFILE
+bin/quux sort $INFILE | cmp $TMPFILE || error "Test natural 1"
+bin/quux -v sort $INFILE 2>&1 >/dev/null | grep sortstats |
+  awk '{ sub(/.*compares=/, ""); exit !($1 < 600) }' || error "Test natural 2"
+awk 'BEGIN { for (i = 191; i >= 0; i--) printf "%03d\n", int(i/6) }' > $TMPFILE
+bin/quux sort -r $INFILE | cmp $TMPFILE || error "Test natural 3"
+
+### Dictionary order and case folding (-d, -f)
+cat << EOT > $INFILE
+B-c
+b c
+a,,z
+A
+EOT
+cat << EOT > $TMPFILE
+A
+a,,z
+B-c
+b c
+EOT
+bin/quux sort -d -f $INFILE | cmp $TMPFILE || error "Test -d 1"
+cat << EOT > $TMPFILE
+A
+a,,z
+b c
+B-c
+EOT
+bin/quux sort -f $INFILE | cmp $TMPFILE || error "Test -d 2"
+
+### External sort (-c): runs from the reading, sorting, and writing
+### threads, merged in passes
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%05d\n", i * 7919 % 20000 }' > $INFILE
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%05d\n", i }' > $TMPFILE
+bin/quux sort -c 4000 $INFILE | cmp $TMPFILE || error "Test -c 1"
+bin/quux sort -c 4000 < $INFILE | cmp $TMPFILE || error "Test -c 2"
+bin/quux sort -c 4000 -z $INFILE | cmp $TMPFILE || error "Test -z 1"
+
+### Memory budget (-S): input that does not fit is sorted externally
+bin/quux sort -S 100K $INFILE | cmp $TMPFILE || error "Test -S 1"
+bin/quux sort -S 100K < $INFILE | cmp $TMPFILE || error "Test -S 2"
+bin/quux -v sort -S 100K $INFILE 2>&1 >/dev/null |
+  grep '^(input exceeds memory budget' >/dev/null || error "Test -S 3"
+bin/quux -v sort -S 10M $INFILE 2>&1 >/dev/null |
+  grep '^(input exceeds' >/dev/null && error "Test -S 4"
+
+### Top-K (-m): the first lines of the sorted order
+test "$(bin/quux sort -m 3 $INFILE)" = "$(head -3 $TMPFILE)" ||
+  error "Test -m 1"
+test "$(bin/quux sort -m 2000 $INFILE)" = "$(head -2000 $TMPFILE)" ||
+  error "Test -m 2"
+test "$(printf 'c\nb\na\n' | bin/quux sort -m 100000000)" = "$(printf 'a\nb\nc')" ||
+  error "Test -m 3"
+
+### Merge (-M): sorted files, each read a buffer at a time
+awk 'BEGIN { for (i = 0; i < 20000; i += 2) printf "%05d\n", i }' > $INFILE
+awk 'BEGIN { for (i = 0; i < 20000; i += 2) printf "%05d\n%05d\n", i, i }' > $TMPFILE
+bin/quux sort -M $INFILE $INFILE | cmp $TMPFILE || error "Test -M 1"
+bin/quux sort -M -u $INFILE $INFILE | cmp $INFILE || error "Test -M 2"
+awk 'BEGIN { for (i = 19998; i >= 0; i -= 2) printf "%05d\n%05d\n", i, i }' > $TMPFILE
+awk 'BEGIN { for (i = 19998; i >= 0; i -= 2) printf "%05d\n", i }' > $INFILE
+bin/quux sort -M -r $INFILE $INFILE | cmp $TMPFILE || error "Test -M 3"
+
+### Unique (-u): equal keys are one line, also across runs
+cat << EOT > $INFILE
+B-c
+b c
+a,,z
+A
+EOT
+cat << EOT > $TMPFILE
+A
+a,,z
+B-c
+EOT
+bin/quux sort -d -f -u $INFILE | cmp $TMPFILE || error "Test -u 1"
+for i in 1 2 3; do seq 20 | sed 's/^/k/'; done > $INFILE
+bin/quux sort -u $INFILE > $TMPFILE
+test $(wc -l < $TMPFILE) -eq 20 || error "Test -u 2"
+bin/quux sort -u -c 40 $INFILE | cmp $TMPFILE || error "Test -u 3"
+bin/quux sort -u -c 40 -z $INFILE | cmp $TMPFILE || error "Test -u 4"
+
+### Parallel merges (-P): the merges of a pass run at once
+bin/quux sort -r $INFILE > $TMPFILE
+bin/quux sort -r -c 40 -P 2 $INFILE | cmp $TMPFILE || error "Test -P 1"
+bin/quux sort -r -c 40 -z -P 2 $INFILE | cmp $TMPFILE || error "Test -P 2"
+
+### Temporary directories (-T): runs spread over each, which
+### are left empty
+bin/quux sort -r -c 40 -T $TDIR1 -T $TDIR2 $INFILE | cmp $TMPFILE ||
+  error "Test -T 1"
+test -z "$(ls -A $TDIR1)$(ls -A $TDIR2)" || error "Test -T 2"
+TMPDIR=$TDIR1 bin/quux sort -r -c 40 -z $INFILE | cmp $TMPFILE ||
+  error "Test -T 3"
+test -z "$(ls -A $TDIR1)" || error "Test -T 4"
+
+### Mapped input: a tab sorts below the newline, which is added
+### to an incomplete last line, also when it ends a page
+printf 'a\tb\na\tb\na\nab' > $INFILE
+printf 'a\tb\na\tb\na\nab\n' > $TMPFILE
+bin/quux sort $INFILE | cmp $TMPFILE || error "Test map 1"
+bin/quux sort < $INFILE | cmp $TMPFILE || error "Test map 2"
+printf 'a\tb\na\nab\n' > $TMPFILE
+bin/quux sort -u $INFILE | cmp $TMPFILE || error "Test map 3"
+awk 'BEGIN { for (i = 0; i < 1023; i++) printf "%03d\n", 999 - i % 1000
+  printf "wxyz" }' > $INFILE
+awk 'BEGIN { for (i = 0; i < 1000; i++)
+  for (j = i < 977 ? 1 : 2; j > 0; j--) printf "%03d\n", i }' > $TMPFILE
+echo wxyz >> $TMPFILE
+bin/quux sort $INFILE | cmp $TMPFILE || error "Test map 4"
+
+### Statistics (-v): the options in effect, the sortstats fields,
+### and the counts that depend only on the runs
+for i in 1 2 3; do seq 20 | sed 's/^/k/'; done > $INFILE
+bin/quux -v sort -D -N -o $TMPFILE $INFILE 2>&1 |
+  grep 'distribute=1, nocache=1, .*output=' >/dev/null || error "Test -v 1"
+echo sortstats compares readtime sorttime spilltime mergetime writetime \
+  spilled reread passes linebuf linepos dropped readahead > $TMPFILE
+bin/quux -v sort -c 40 $INFILE 2>&1 >/dev/null | grep '^sortstats' |
+  sed 's/=[^ ]*//g' | cmp $TMPFILE || error "Test -v 2"
+bin/quux -v sort -c 40 $INFILE 2>&1 >/dev/null | grep '^sortstats' |
+  grep ' spilled=548 reread=548 passes=2 ' >/dev/null || error "Test -v 3"
+
+### Output file (-o): replaced when complete, so it can be the
+### input; through a symlink, and in place if it has other links
+### or is not a regular file
+printf 'c\nb\na\n' > $INFILE
+printf 'a\nb\nc\n' > $TMPFILE
+bin/quux sort -o $INFILE $INFILE && cmp $INFILE $TMPFILE || error "Test -o 1"
+ln -s $INFILE $TDIR1/link
+printf 'c\nb\na\n' > $INFILE
+bin/quux sort -o $TDIR1/link $TDIR1/link && test -L $TDIR1/link &&
+  cmp $INFILE $TMPFILE || error "Test -o 2"
+ln $INFILE $TDIR1/hard
+printf 'a\nb\nc\nb\n' > $INFILE
+printf 'c\nb\na\n' > $TMPFILE
+bin/quux sort -r -u -o $INFILE $INFILE && cmp $TDIR1/hard $TMPFILE ||
+  error "Test -o 3"
+mkfifo $TDIR1/fifo
+cat $TDIR1/fifo > $TDIR1/out &
+if bin/quux sort -r -o $TDIR1/fifo $INFILE && test -p $TDIR1/fifo; then
+  wait $!
+  cmp $TDIR1/out $TMPFILE || error "Test -o 4"
+else
+  kill $!
+  error "Test -o 4"
+fi
+rm -f $TDIR1/link $TDIR1/hard $TDIR1/fifo $TDIR1/out
+
+### Distribution sort (-D): buckets split at a sample of the input
+### (the first chunk, from a pipe), no more than half of -S buffers
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%05d\n", i * 7919 % 20000 }' > $INFILE
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%05d\n", i }' > $TMPFILE
+bin/quux sort -D -S 100K $INFILE | cmp $TMPFILE || error "Test -D 1"
+cat $INFILE | bin/quux sort -D -S 100K | cmp $TMPFILE || error "Test -D 2"
+cat $INFILE | bin/quux -v sort -D -S 100K 2>&1 >/dev/null |
+  grep -E '^\(distribution sort used [0-9]{1,2} buckets' >/dev/null ||
+  error "Test -D 3"
+for i in 1 2 3; do seq 20 | sed 's/^/k/'; done > $INFILE
+bin/quux sort -u $INFILE > $TMPFILE
+bin/quux sort -u -c 40 -D $INFILE | cmp $TMPFILE || error "Test -D 4"
+bin/quux sort -r $INFILE > $TMPFILE
+bin/quux sort -r -c 40 -D $INFILE | cmp $TMPFILE || error "Test -D 5"
+
+### No cache (-N): temp files are advised out of the page cache
+### once written and once read, and read ahead
+for i in 1 2 3; do seq 20 | sed 's/^/k/'; done > $INFILE
+bin/quux sort $INFILE > $TMPFILE
+bin/quux sort -N -c 40 $INFILE | cmp $TMPFILE || error "Test -N 1"
+bin/quux sort -N -c 40 -z $INFILE | cmp $TMPFILE || error "Test -N 2"
+bin/quux sort -N -c 40 -D $INFILE | cmp $TMPFILE || error "Test -N 3"
+bin/quux -v sort -N -c 40 $INFILE 2>&1 >/dev/null | grep '^sortstats' |
+  grep ' spilled=548 .* dropped=1096 readahead=548$' >/dev/null ||
+  error "Test -N 4"
+bin/quux -v sort -c 40 $INFILE 2>&1 >/dev/null | grep '^sortstats' |
+  grep ' dropped=0 readahead=0$' >/dev/null || error "Test -N 5"
+
+### Check only (-C): status 1 and the first line out of order
+printf 'a\nb\nb\nc\na\n' > $INFILE
+head -4 $INFILE | bin/quux sort -C || error "Test -C 1"
+echo "quux sort: stdin:5: disorder: a" > $TMPFILE
+bin/quux sort -C < $INFILE 2>&1 | cmp $TMPFILE || error "Test -C 2"
+bin/quux sort -C < $INFILE 2>/dev/null
+test $? -eq 1 || error "Test -C 3"
+echo "quux sort: $INFILE:5: disorder: a" > $TMPFILE
+bin/quux sort -C $INFILE 2>&1 | cmp $TMPFILE || error "Test -C 4"
+echo "quux sort: stdin:3: disorder: b" > $TMPFILE
+head -4 $INFILE | bin/quux sort -C -u 2>&1 | cmp $TMPFILE || error "Test -C 5"
+printf '3\n20\n100\n' | bin/quux sort -C -n || error "Test -C 6"
+
+exit $status
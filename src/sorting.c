@@ -63,38 +63,101 @@ shellsort(int v[], int n)
 }
 
 
-/* Quick sort: section 4.4, O(n log n), worst case O(n^2), recursive */
+/* Quick sort: section 4.4, O(n log n), worst case O(n^2), recursive;
+   here with three-way partitioning (items equal to the pivot are
+   gathered in the middle and never looked at again, so many equal
+   items are no problem), median-of-three pivot selection, insertion
+   sort for short ranges, and a fall back to heap sort if recursion
+   gets too deep (Musser's "introsort"), which guarantees O(n log n) */
+
+#define CUTOFF 12 /* ranges up to this length use insertion sort */
+
+static void /* sort v[lo..hi] by straight insertion */
+insertsort2(int v[], int lo, int hi, int (*cmp)(int,int,void*), void *userdata)
+{
+  int i, j;
+  for (i = lo+1; i <= hi; i++) {
+    int t = v[i];
+    for (j = i; j > lo && cmp(v[j-1], t, userdata) > 0; j--)
+      v[j] = v[j-1];
+    v[j] = t;
+  }
+}
+
+static void /* sift v[lo+i] down the heap v[lo..lo+n-1] (0-based) */
+siftdown(int v[], int lo, int i, int n, int (*cmp)(int,int,void*), void *userdata)
+{
+  int j;
+  while ((j = 2*i+1) < n) {
+    if (j+1 < n && cmp(v[lo+j], v[lo+j+1], userdata) < 0) j += 1;
+    if (cmp(v[lo+i], v[lo+j], userdata) >= 0) break;
+    swap(v, lo+i, lo+j);
+    i = j;
+  }
+}
+
+static void /* sort v[lo..hi] by heap sort: O(n log n) in all cases */
+heapsort2(int v[], int lo, int hi, int (*cmp)(int,int,void*), void *userdata)
+{
+  int i, n = hi-lo+1;
+  for (i = n/2-1; i >= 0; i--)
+    siftdown(v, lo, i, n, cmp, userdata);
+  while (n > 1) {
+    swap(v, lo, lo+n-1); /* move max to end */
+    siftdown(v, lo, 0, --n, cmp, userdata);
+  }
+}
 
 static void /* sort v[lo..hi] */
-quicksort2(int v[], int lo, int hi, int (*cmp)(int,int,void*), void *userdata)
+quicksort2(int v[], int lo, int hi, int depth, int (*cmp)(int,int,void*), void *userdata)
 {
-  int i, last; /* indices into v[] */
-
-  if (lo >= hi) return; /* nothing to sort */
-
-  /* partition */
-  swap(v, lo, (lo+hi)/2); /* use middle elem as pivot, place in v[lo] */
-  last = lo;              /* v[lo..last-1] is the items < pivot */
-  for (i = lo+1; i <= hi; i++)
-    if (cmp(v[i], v[lo], userdata) < 0) /* v[i] less than pivot? */
-      swap(v, ++last, i); /* yes: swap into left subset */
-  swap(v, lo, last);      /* restore pivot; we know v[last] <= v[lo] */
-
-  /* recurse smaller subset first (to min stack depth) */
-  if (last-lo < hi-last) {
-    quicksort2(v, lo, last-1, cmp, userdata);
-    quicksort2(v, last+1, hi, cmp, userdata);
-  } else {
-    quicksort2(v, last+1, hi, cmp, userdata);
-    quicksort2(v, lo, last-1, cmp, userdata);
+  int i, lt, gt, mid, pivot; /* indices into v[], pivot value */
+
+  while (hi-lo >= CUTOFF) {
+    if (depth-- <= 0) { /* too deep: bad pivots */
+      heapsort2(v, lo, hi, cmp, userdata);
+      return;
+    }
+
+    /* median of three: order v[lo] <= v[mid] <= v[hi] */
+    mid = lo + (hi-lo)/2;
+    if (cmp(v[mid], v[lo], userdata) < 0) swap(v, lo, mid);
+    if (cmp(v[hi], v[mid], userdata) < 0) {
+      swap(v, mid, hi);
+      if (cmp(v[mid], v[lo], userdata) < 0) swap(v, lo, mid);
+    }
+    pivot = v[mid];
+
+    /* partition: v[lo..lt-1] < pivot, v[lt..gt] == pivot,
+       v[gt+1..hi] > pivot, and v[i..gt] not yet looked at */
+    lt = lo; gt = hi; i = lo;
+    while (i <= gt) {
+      int c = cmp(v[i], pivot, userdata);
+      if (c < 0) swap(v, lt++, i++);
+      else if (c > 0) swap(v, i, gt--);
+      else i++;
+    }
+
+    /* recurse smaller subset, loop on the larger (to min stack depth) */
+    if (lt-lo < hi-gt) {
+      quicksort2(v, lo, lt-1, depth, cmp, userdata);
+      lo = gt+1;
+    } else {
+      quicksort2(v, gt+1, hi, depth, cmp, userdata);
+      hi = lt-1;
+    }
   }
+
+  insertsort2(v, lo, hi, cmp, userdata);
 }
 
 void /* sort v[0..n-1] */
 quicksort(int v[], int n, int (*cmp)(int,int,void*), void *userdata)
 {
+  int depth = 0, k;
   if (!cmp) cmp = defaultcmp;
-  quicksort2(v, 0, n-1, cmp, userdata);
+  for (k = n; k > 1; k /= 2) depth += 2; /* 2*log2(n) */
+  quicksort2(v, 0, n-1, depth, cmp, userdata);
 }
 
 void /* restore the heap property after heap[1] changed */
@@ -111,6 +174,45 @@ reheap(int heap[], int n, int (*cmp)(int,int,void*), void *userdata)
   }
 }
 
+/* Loser tree (tournament tree) for k-way merging: the leaves are
+   the k inputs 0..k-1, leaf i sits below node (k+i)/2; each inner
+   node tree[1..k-1] holds the loser of the match played there, and
+   tree[0] holds the overall winner; after the winner's input has
+   advanced, only the matches on its path to the root are replayed:
+   log2(k) comparisons, against a heap's 2 log2(k) */
+
+void /* build the loser tree over inputs 0..k-1 */
+losertree(int tree[], int k, int (*cmp)(int,int,void*), void *userdata)
+{
+  int i, node, t, w;
+  if (!cmp) cmp = defaultcmp;
+  for (node = 0; node < k; node++)
+    tree[node] = -1; /* no match played yet */
+  for (i = 0; i < k; i++) {
+    w = i; /* play leaf i upwards until it waits for an opponent */
+    for (node = (k+i)/2; node > 0; node /= 2) {
+      if (tree[node] < 0) { tree[node] = w; break; }
+      if (cmp(tree[node], w, userdata) < 0) {
+        t = tree[node]; tree[node] = w; w = t; /* loser stays */
+      }
+    }
+    if (node == 0) tree[0] = w;
+  }
+}
+
+void /* replay the matches of winner tree[0] after it changed */
+loserupdate(int tree[], int k, int (*cmp)(int,int,void*), void *userdata)
+{
+  int node, t, w = tree[0];
+  if (!cmp) cmp = defaultcmp;
+  for (node = (k+w)/2; node > 0; node /= 2) {
+    if (cmp(tree[node], w, userdata) < 0) {
+      t = tree[node]; tree[node] = w; w = t; /* loser stays */
+    }
+  }
+  tree[0] = w;
+}
+
 void /* random permutation of v[0..n-1] (Fisher-Yates) */
 shuffle(int v[], int n, int (*rnd)(int))
 {
@@ -6,6 +6,8 @@ void bubblesort(int v[], int n);
 void shellsort(int v[], int n);
 void quicksort(int v[], int n, int (*cmp)(int,int,void*), void*);
 void reheap(int heap[], int n, int (*cmp)(int,int,void*), void*);
+void losertree(int tree[], int k, int (*cmp)(int,int,void*), void*);
+void loserupdate(int tree[], int k, int (*cmp)(int,int,void*), void*);
 void shuffle(int v[], int n, int (*rnd)(int));
 
 #endif
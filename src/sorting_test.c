@@ -12,6 +12,9 @@
 static void quickwrap(int v[], int n);
 static void libcsort(int v[], int n);
 static int qcompare(const void *p, const void *q);
+static int countcmp(int a, int b, void *pcount);
+static bool sorted(int v[], int n);
+static int runcmp(int i, int j, void *runs);
 
 static bool equals(int a[], int b[], int n);
 static void reverse(int v[], int n);
@@ -20,6 +23,8 @@ static void print(int v[], int n);
 typedef void (*sortproc)(int*,int);
 static double bench(int a[], int n, int repeats, sortproc);
 
+struct testrun { int *v; int n; }; /* for losertree() */
+
 static int a[] = { 6, 10, 3, 2, 4, 8, 1, 7, 5, 9 };
 static int b[] = { 6, 10, 3, 2, 4, 8, 1, 7, 5, 9 };
 static int c[] = { 6, 10, 3, 2, 4, 8, 1, 7, 5, 9 };
@@ -140,6 +145,34 @@ sorting_test(int *pnumpass, int *pnumfail)
   quicksort(c, 0, 0, 0);
   TEST("sort empty", equals(c, r, n));
 
+  HEADING("Testing Quick Sort on input shapes");
+  n = sizeof(large)/sizeof(large[0]);
+  int *d = calloc(n, sizeof(int)), *e = calloc(n, sizeof(int));
+  if (!d || !e) abort();
+  memcpy(d, large, n*sizeof(int));
+  memcpy(e, large, n*sizeof(int));
+  quicksort(d, n, 0, 0);
+  libcsort(e, n);
+  TEST("sort 1000 ints", equals(d, e, n));
+  quicksort(d, n, 0, 0);
+  TEST("sort sorted", equals(d, e, n));
+  reverse(d, n);
+  quicksort(d, n, 0, 0);
+  TEST("sort reverse sorted", equals(d, e, n));
+  for (int i = 0; i < n; i++) d[i] = i < n/2 ? i : n-i; /* organ pipe */
+  quicksort(d, n, 0, 0);
+  TEST("sort organ pipe", sorted(d, n));
+  for (int i = 0; i < n; i++) d[i] = i % 3;
+  quicksort(d, n, 0, 0);
+  TEST("sort few distinct", sorted(d, n));
+  long count = 0;
+  for (int i = 0; i < n; i++) d[i] = 7;
+  quicksort(d, n, countcmp, &count);
+  TEST("sort identical: linear #compares", sorted(d, n) && count < 2*n);
+  INFO("%ld compares to sort %d identical items", count, n);
+  free(d);
+  free(e);
+
   HEADING("Comparing Bubble/Shell/Quick Sort");
 
   n = sizeof(small)/sizeof(small[0]);
@@ -189,6 +222,22 @@ sorting_test(int *pnumpass, int *pnumfail)
   int exph4[] = {0,3,4,6,9,5,9};
   TEST("h[1]=9; reheap", equals(exph4, heap, 7));
 
+  HEADING("Testing losertree()");
+  int r0[] = {1, 4, 9, 9}, r1[] = {2, 3}, r2[] = {0}, r4[] = {5, 6, 7, 8};
+  struct testrun runs[] = {{r0, 4}, {r1, 2}, {r2, 1}, {0, 0}, {r4, 4}};
+  int merged[11], tree[5], k = 5, nmerged = 0;
+  losertree(tree, k, runcmp, runs);
+  while (runs[tree[0]].n > 0) {
+    merged[nmerged++] = *runs[tree[0]].v++;
+    runs[tree[0]].n -= 1;
+    loserupdate(tree, k, runcmp, runs);
+  }
+  int expmerged[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 9};
+  TEST("merge 5 runs (one empty)", nmerged == 11 && equals(merged, expmerged, 11));
+  struct testrun single[] = {{r4, 4}};
+  losertree(tree, 1, runcmp, single);
+  TEST("single run", tree[0] == 0);
+
   HEADING("Testing shuffle()");
   int v[] = {0,1,2,3,4,5};
   shuffle(v, 0, 0);
@@ -214,6 +263,16 @@ equals(int a[], int b[], int n)
   return true;
 }
 
+static bool /* return true iff v[0..n-1] is in ascending order */
+sorted(int v[], int n)
+{
+  int i;
+  for (i = 1; i < n; i++)
+    if (v[i-1] > v[i])
+      return false;
+  return true;
+}
+
 static void /* reverse v[0..n-1] */
 reverse(int v[], int n)
 {
@@ -254,6 +313,22 @@ qcompare(const void *p, const void *q)
   return ip - iq;
 }
 
+static int /* compare function that counts its calls */
+countcmp(int a, int b, void *pcount)
+{
+  *(long *) pcount += 1;
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static int /* compare heads of runs; exhausted runs come last */
+runcmp(int i, int j, void *runs)
+{
+  struct testrun *rp = runs;
+  if (rp[i].n == 0) return rp[j].n == 0 ? 0 : 1;
+  if (rp[j].n == 0) return -1;
+  return *rp[i].v - *rp[j].v;
+}
+
 static double
 bench(int a[], int n, int repeats, void (*sorter)(int *, int))
 {
@@ -1,4 +1,6 @@
 
+#define _POSIX_C_SOURCE 200112L /* getc_unlocked */
+
 #include <assert.h>
 #include <ctype.h>
 
@@ -161,9 +163,13 @@ filecopy(FILE *ifp, FILE *ofp)
 {
   /* TODO try fread/fwrite with a buffer of BUFSIZ (stdio.h) */
   int c;
-  while ((c = getc(ifp)) != EOF) {
-    putc(c, ofp);
+  flockfile(ifp); /* lock once, not for every char */
+  flockfile(ofp);
+  while ((c = getc_unlocked(ifp)) != EOF) {
+    putc_unlocked(c, ofp);
   }
+  funlockfile(ofp);
+  funlockfile(ifp);
 }
 
 /* getline: read chars up to (and including) the first delim,